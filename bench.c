@@ -0,0 +1,410 @@
+/*
+ * Microbenchmarks for the server's hot paths.
+ *
+ * game.c is compiled into this program with its main() renamed, so the
+ * real functions run in-process on one shard: framing lobby lines and
+ * playing match turns, speech included, through handleclient(),
+ * rendering turn screens, and, at several lobby sizes, adding, removing
+ * and rotating clients, match_opponent() and broadcast() fan-out.
+ * Sockets are mocked. Clients get descriptor numbers that are never
+ * touched, except for the input benchmarks, which read from a
+ * socketpair, and queued output is dropped instead of written.
+ *
+ * Each result is one "name ns_per_op" line, the best of -r runs, so a
+ * run saved to a file is a baseline:
+ *     ./bench > bench.base
+ *     ./bench -c bench.base -t 10
+ * With -c every result is shown next to the baseline's, and any more
+ * than -t percent slower is marked REGRESSION.
+ * Exits with status 1 if there was a regression.
+ */
+
+#define main game_main
+#include "game.c"
+#undef main
+
+# define BENCH_MAX 32          // results in one run
+# define INPUT_BATCH 32        // lines written to the socket per handleclient()
+# define FAKE_FD 1000          // first mocked descriptor
+
+struct result {
+    char name[64];
+    double ns;
+};
+
+static struct client *head;
+static int next_fd = FAKE_FD;
+
+/* Set up the calling thread as shard 0, without starting its loop. */
+static void bench_init(void) {
+    self = &shards[0];
+    rng_seed(&rng, 1);
+    log_level = LOG_ERROR;
+    tpl_init();
+    wheel_now = now_ns() / 1000000 / TICK_MS;
+
+    head = calloc(1, sizeof(struct client));
+    if (head == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    head->in_game = 1;
+    head->name_set = 1;
+    head->prev = head;
+}
+
+/* A named lobby client on a mocked descriptor. */
+static struct client *bench_client(int fd, int rating) {
+    struct in_addr addr = { htonl(INADDR_LOOPBACK) };
+    struct client *p = newclient(head, fd >= 0 ? fd : next_fd++, addr);
+
+    snprintf(p->name, sizeof(p->name), "player%d", p->fd);
+    p->name_set = 1;
+    p->rating = rating;
+    update_timeout(p);
+    return p;
+}
+
+/* Throw away whatever p has queued, as if the socket had taken it. */
+static void drop_output(struct client *p) {
+    while (p->out_head != NULL) {
+        struct outseg *seg = p->out_head;
+        p->out_head = seg->next;
+        outseg_free(seg);
+    }
+    p->out_tail = NULL;
+    p->out_off = 0;
+    p->out_bytes = 0;
+    unlink_flush(p);
+}
+
+static void remove_all(void) {
+    while (head->next != NULL) {
+        removeclient(head, head->next->fd);
+    }
+    next_fd = FAKE_FD;
+}
+
+/* Frame and handle INPUT_BATCH lobby lines per read burst. The lobby
+ * ignores them, so this is the cost of reading and framing.
+ * returns ns per line
+ */
+static double bench_input(int iters) {
+    char batch[INPUT_BATCH * 8];
+    int sv[2], len = 0;
+    uint64_t total = 0;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == -1) {
+        perror("socketpair");
+        exit(1);
+    }
+    struct client *p = bench_client(sv[0], RATING_START);
+    for (int i = 0; i < INPUT_BATCH; i++) {
+        len += snprintf(batch + len, sizeof(batch) - len, "attack\n");
+    }
+
+    for (int i = 0; i < iters; i++) {
+        if (write(sv[1], batch, len) != len) {
+            perror("write");
+            exit(1);
+        }
+        uint64_t t = now_ns();
+        if (handleclient(p, head) == -1) {
+            fprintf(stderr, "bench: handleclient failed\n");
+            exit(1);
+        }
+        total += now_ns() - t;
+        drop_output(p);
+    }
+    remove_all();
+    close(sv[0]);
+    close(sv[1]);
+    return (double)total / ((double)iters * INPUT_BATCH);
+}
+
+/* Play one turn per read burst in a match: SPEAK_LIMIT speeches, each
+ * an "s" line and what is said, then an attack or a powermove, in turn.
+ * The fight is set back up untimed before each turn, so every line
+ * does its work and the match never ends.
+ * returns ns per line
+ */
+static double bench_moves(int iters) {
+    char batch[SPEAK_LIMIT * 16 + 4];
+    int sv[2], len = 0, lines = SPEAK_LIMIT * 2 + 1;
+    uint64_t total = 0;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == -1) {
+        perror("socketpair");
+        exit(1);
+    }
+    struct client *p = bench_client(sv[0], RATING_START);
+    struct client *q = bench_client(-1, RATING_START);
+    struct seat *ps = seat_attach(p), *qs = seat_attach(q);
+
+    ps->opponent = q;
+    qs->opponent = p;
+    p->in_game = q->in_game = 1;
+    for (int i = 0; i < SPEAK_LIMIT; i++) {
+        len += snprintf(batch + len, sizeof(batch) - len, "s\ngood game\n");
+    }
+
+    for (int i = 0; i < iters; i++) {
+        batch[len] = i % 2 ? 'p' : 'a';
+        batch[len + 1] = '\n';
+        fight_start(&ps->fight, &qs->fight, &rng);
+        ps->fight.is_turn = 1;
+        qs->fight.is_turn = 0;
+        ps->fight.power_moves = POWER_MOVES_MAX;
+        if (write(sv[1], batch, len + 2) != len + 2) {
+            perror("write");
+            exit(1);
+        }
+        uint64_t t = now_ns();
+        if (handleclient(p, head) == -1) {
+            fprintf(stderr, "bench: handleclient failed\n");
+            exit(1);
+        }
+        total += now_ns() - t;
+        drop_output(p);
+        drop_output(q);
+    }
+
+    ps->opponent = qs->opponent = NULL;
+    p->in_game = q->in_game = 0;
+    remove_all();
+    close(sv[0]);
+    close(sv[1]);
+    return (double)total / ((double)iters * lines);
+}
+
+/* Render the screen a player gets when hit, status and menu included.
+ * returns ns per screen
+ */
+static double bench_render(int iters, int binary) {
+    struct client *p = bench_client(-1, RATING_START);
+    struct client *q = bench_client(-1, RATING_START);
+
+    struct seat *ps = seat_attach(p), *qs = seat_attach(q);
+
+    ps->opponent = q;
+    qs->opponent = p;
+    p->in_game = q->in_game = 1;
+    fight_start(&ps->fight, &qs->fight, &rng);
+    p->binary = binary;
+
+    uint64_t t = now_ns();
+    for (int i = 0; i < iters; i++) {
+        msgbuf_put(render_screen(p, T_GOT_HIT, SCR_STATUS | SCR_MENU, ATTACK_DAMAGE, NULL));
+    }
+    uint64_t total = now_ns() - t;
+
+    ps->opponent = qs->opponent = NULL;
+    p->in_game = q->in_game = 0;
+    remove_all();
+    return (double)total / iters;
+}
+
+/* With n clients in the lobby, accept and tear down a connection,
+ * prompt included, and send the front client to the back of the list
+ * the way end_match() does.
+ * returns ns per add, remove and move
+ */
+static double bench_churn(int iters, int n) {
+    struct in_addr addr = { htonl(INADDR_LOOPBACK) };
+    int fd = FAKE_FD + n;
+
+    for (int i = 0; i < n; i++) {
+        bench_client(-1, RATING_START);
+    }
+
+    uint64_t t = now_ns();
+    for (int i = 0; i < iters; i++) {
+        addclient(head, fd, addr);
+        removeclient(head, fd);
+        move_client_end(&head, head->next);
+    }
+    uint64_t total = now_ns() - t;
+
+    remove_all();
+    return (double)total / iters;
+}
+
+/* Matchmaking with n players waiting, rated around RATING_START. Each
+ * pairing is undone untimed, so the queue stays n long.
+ * returns ns per match_opponent() call
+ */
+static double bench_match(int iters, int n) {
+    uint64_t total = 0;
+
+    for (int i = 0; i < n; i++) {
+        int rating = RATING_START - 300 + (int)rng_below(&rng, 601);
+        enqueue_waiting(bench_client(-1, rating));
+    }
+
+    for (int i = 0; i < iters; i++) {
+        struct client *p = wait_head;
+        uint64_t t = now_ns();
+        struct client *q = match_opponent(p, t);
+        total += now_ns() - t;
+
+        if (q == NULL) {
+            // Nobody close enough; let the next in line try
+            dequeue_waiting(p);
+            enqueue_waiting(p);
+            continue;
+        }
+        match_free(p->seat->match);
+        p->seat->match = q->seat->match = NULL;
+        p->seat->opponent = q->seat->opponent = NULL;
+        p->in_game = q->in_game = 0;
+        fight_reset(&p->seat->fight, &rng);
+        fight_reset(&q->seat->fight, &rng);
+        drop_output(p);
+        drop_output(q);
+        update_timeout(p);
+        update_timeout(q);
+        enqueue_waiting(p);
+        enqueue_waiting(q);
+    }
+    remove_all();
+    return (double)total / iters;
+}
+
+/* Announce a player joining to n other clients.
+ * returns ns per broadcast
+ */
+static double bench_broadcast(int iters, int n) {
+    uint64_t total = 0;
+    struct client *subject = bench_client(-1, RATING_START);
+
+    for (int i = 0; i < n; i++) {
+        bench_client(-1, RATING_START);
+    }
+    for (int i = 0; i < iters; i++) {
+        uint64_t t = now_ns();
+        broadcast(head, subject, T_JOINS);
+        total += now_ns() - t;
+        for (struct client *p = head->next; p != NULL; p = p->next) {
+            drop_output(p);
+        }
+    }
+    remove_all();
+    return (double)total / iters;
+}
+
+static int bench_count;
+static struct result bench_results[BENCH_MAX];
+
+/* Keep the best of the runs for each result. */
+static void record(const char *name, double ns) {
+    for (int i = 0; i < bench_count; i++) {
+        if (!strcmp(bench_results[i].name, name)) {
+            if (ns < bench_results[i].ns) {
+                bench_results[i].ns = ns;
+            }
+            return;
+        }
+    }
+    if (bench_count < BENCH_MAX) {
+        snprintf(bench_results[bench_count].name, sizeof(bench_results[bench_count].name), "%s", name);
+        bench_results[bench_count++].ns = ns;
+    }
+}
+
+static void run_all(void) {
+    static const int lobby[] = { 10, 100, 1000, 10000 };
+    static const int fanout[] = { 100, 1000, 10000 };
+    static const int crowd[] = { 100, 1000, 10000, 100000 };
+    char name[64];
+
+    record("handleclient_line", bench_input(20000));
+    record("handleclient_move", bench_moves(100000));
+    record("render_turn_text", bench_render(1000000, 0));
+    record("render_turn_binary", bench_render(1000000, 1));
+    for (size_t i = 0; i < sizeof(crowd) / sizeof(crowd[0]); i++) {
+        snprintf(name, sizeof(name), "client_churn_%d", crowd[i]);
+        record(name, bench_churn(200000, crowd[i]));
+    }
+    for (size_t i = 0; i < sizeof(lobby) / sizeof(lobby[0]); i++) {
+        snprintf(name, sizeof(name), "match_opponent_%d", lobby[i]);
+        record(name, bench_match(100000, lobby[i]));
+    }
+    for (size_t i = 0; i < sizeof(fanout) / sizeof(fanout[0]); i++) {
+        snprintf(name, sizeof(name), "broadcast_%d", fanout[i]);
+        record(name, bench_broadcast(2000000 / fanout[i], fanout[i]));
+    }
+}
+
+/* Read a baseline written by an earlier run.
+ * returns the number of results read
+ */
+static int load_baseline(const char *path, struct result *base) {
+    FILE *f = fopen(path, "r");
+    int n = 0;
+
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    while (n < BENCH_MAX && fscanf(f, "%63s %lf", base[n].name, &base[n].ns) == 2) {
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+int main(int argc, char **argv) {
+    struct result base[BENCH_MAX];
+    const char *baseline = NULL;
+    double threshold = 10;
+    int runs = 5, nbase = 0, regressions = 0, opt;
+
+    while ((opt = getopt(argc, argv, "r:c:t:")) != -1) {
+        switch (opt) {
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 'c':
+            baseline = optarg;
+            break;
+        case 't':
+            threshold = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-r runs] [-c baseline_file] [-t threshold_percent]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (baseline != NULL) {
+        nbase = load_baseline(baseline, base);
+    }
+
+    bench_init();
+    if (baseline != NULL) {
+        printf("%-24s %10s %10s %8s\n", "name", "ns/op", "baseline", "change");
+    }
+    for (int r = 0; r < (runs > 0 ? runs : 1); r++) {
+        run_all();
+    }
+
+    for (int i = 0; i < bench_count; i++) {
+        struct result *now = &bench_results[i], *was = NULL;
+        for (int j = 0; j < nbase; j++) {
+            if (!strcmp(base[j].name, now->name)) {
+                was = &base[j];
+            }
+        }
+        if (baseline == NULL) {
+            printf("%s %.1f\n", now->name, now->ns);
+        } else if (was == NULL || was->ns <= 0) {
+            printf("%-24s %10.1f %10s\n", now->name, now->ns, "new");
+        } else {
+            double change = 100 * (now->ns - was->ns) / was->ns;
+            int worse = change > threshold;
+            regressions += worse;
+            printf("%-24s %10.1f %10.1f %+7.1f%%%s\n", now->name, now->ns, was->ns, change,
+                   worse ? "  REGRESSION" : "");
+        }
+    }
+    return regressions != 0;
+}
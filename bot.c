@@ -0,0 +1,516 @@
+/*
+ * Load generator for the arena server.
+ *
+ * Opens many concurrent connections to game.c, answers the name prompt,
+ * plays attack/powermove/speak turns by reading the "It's your turn"
+ * prompts and reconnects whenever a match ends. When the run is over it
+ * reports join-to-match latency, turn round-trip percentiles and the
+ * sustained turn rate.
+ *
+ * Everything runs in one epoll loop against a local server:
+ *     ./bot -c 2000 -d 30
+ * With -b the bots negotiate the binary protocol from proto.h instead
+ * of parsing the text screens. Idle connections alone measure how fast
+ * the server takes a burst of connects:
+ *     ./bot -c 0 -i 10000 -d 5
+ * If the server's stats endpoint answers,
+ * the report includes how many system calls the server made per turn,
+ * and for a run of idle connections only, how much memory the server
+ * holds for each.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <signal.h>
+#include <stdint.h>
+
+#include "hist.h"
+#include "proto.h"
+
+#ifndef PORT
+    #define PORT 51360
+#endif
+
+# define MAXEVENTS 256
+# define TEXT_SIZE 4096    // server text kept while looking for a prompt
+
+enum botstate { CONNECTING, NAMING, LOBBY, PLAYING };
+
+struct bot {
+    int fd;
+    int id;
+    int gen;                 // Reconnect count, keeps names unique
+    int idle;                // Connects but never names itself
+    enum botstate state;
+    int broken;              // A write failed, reconnect once parsing is done
+    int hello_sent;          // Binary protocol requested on this connection
+    char text[TEXT_SIZE];    // Unparsed server output
+    int tlen;
+    uint64_t connect_at;     // When connect() was called
+    uint64_t joined_at;      // When the name was sent
+    uint64_t move_at;        // When the outstanding move was sent, 0 if none
+};
+
+static int epfd;
+static struct sockaddr_in server;
+static struct hist connect_hist, join_hist, turn_hist;
+static uint64_t turns, matches, reconnects, bytes_in, connect_errors, connects;
+static uint64_t last_connect;    // When the latest connection got its prompt
+static int binary;           // Use the binary protocol
+
+static void hist_print(const char *what, struct hist *h) {
+    printf("%-14s n=%-9llu p50=%8.3fms p99=%8.3fms p999=%8.3fms\n", what,
+           (unsigned long long)h->count, hist_pct(h, 50) / 1e6,
+           hist_pct(h, 99) / 1e6, hist_pct(h, 99.9) / 1e6);
+}
+
+/* Ask the server's stats endpoint for one of its values.
+ * returns the value, or -1 if the endpoint could not be read
+ */
+static long long server_stat(int port, const char *name) {
+    struct sockaddr_in addr = server;
+    char buf[8192];
+    int fd, n = 0, len;
+
+    if (port <= 0 || (fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        return -1;
+    }
+    // A server out of descriptors never answers
+    struct timeval tv = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    while (n < (int)sizeof(buf) - 1 && (len = read(fd, buf + n, sizeof(buf) - 1 - n)) > 0) {
+        n += len;
+    }
+    close(fd);
+    buf[n] = '\0';
+
+    char key[64];
+    snprintf(key, sizeof(key), "\n%s ", name);
+    char *line = strstr(buf, key);
+    return line ? atoll(line + strlen(key)) : -1;
+}
+
+static void send_bytes(struct bot *b, const void *s, size_t len) {
+    // Lines are tiny, a short write means the connection is unusable
+    if (write(b->fd, s, len) != (ssize_t)len) {
+        b->broken = 1;
+    }
+}
+
+static void send_line(struct bot *b, const char *s) {
+    send_bytes(b, s, strlen(s));
+}
+
+/* Start (or restart) b's connection to the server. */
+static void bot_connect(struct bot *b) {
+    struct epoll_event ev;
+
+    b->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (b->fd == -1) {
+        perror("socket");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(b->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(b->fd, (struct sockaddr *)&server, sizeof(server)) == -1 && errno != EINPROGRESS) {
+        perror("connect");
+        exit(1);
+    }
+    b->state = CONNECTING;
+    b->connect_at = now_ns();
+    b->broken = 0;
+    b->hello_sent = 0;
+    b->tlen = 0;
+    b->move_at = 0;
+
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = b;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, b->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+static void bot_reconnect(struct bot *b) {
+    close(b->fd);
+    b->gen++;
+    reconnects++;
+    bot_connect(b);
+}
+
+/* Pick a move the way a casual player would: mostly attacks, a
+ * powermove when the menu offers one, and the odd line of chat.
+ */
+static void bot_move(struct bot *b) {
+    int r = rand() % 100;
+
+    if (r < 10 && strstr(b->text, "(s)peak") != NULL) {
+        send_line(b, "s\ngood game so far\n");
+    } else if (r < 35 && strstr(b->text, "(p)owermove") != NULL) {
+        send_line(b, "p\n");
+    } else {
+        send_line(b, "a\n");
+    }
+    b->move_at = now_ns();
+}
+
+/* bot_move() for the binary protocol, driven by the frame's flags. */
+static void bot_move_binary(struct bot *b, int flags) {
+    static const char chat[] = { OP_SPEAK, 16, 'g', 'o', 'o', 'd', ' ', 'g', 'a', 'm', 'e', ' ', 's', 'o', ' ', 'f', 'a', 'r' };
+    char op;
+    int r = rand() % 100;
+
+    if (r < 10 && (flags & FRF_CAN_SPEAK)) {
+        send_bytes(b, chat, sizeof(chat));
+    } else if (r < 35 && (flags & FRF_CAN_POWER)) {
+        op = OP_POWERMOVE;
+        send_bytes(b, &op, 1);
+    } else {
+        op = OP_ATTACK;
+        send_bytes(b, &op, 1);
+    }
+    b->move_at = now_ns();
+}
+
+/* React to one complete frame from the server.
+ * returns 1 if the bot reconnected and the rest of its input is void
+ */
+static int bot_frame(struct bot *b, const unsigned char *f) {
+    uint64_t now = now_ns();
+    char name[64];
+
+    if (f[0] == FR_HELLO || f[0] == FR_NAME_TAKEN) {
+        // A name another bot run holds is retried one generation on
+        b->gen += f[0] == FR_NAME_TAKEN;
+        int len = snprintf(name + 2, sizeof(name) - 2, "bot%d_%d", b->id, b->gen);
+        name[0] = OP_NAME;
+        name[1] = len;
+        send_bytes(b, name, len + 2);
+        b->joined_at = now;
+        b->state = LOBBY;
+        return 0;
+    }
+    if (f[0] == FR_ENGAGE && b->state == LOBBY) {
+        hist_add(&join_hist, now - b->joined_at);
+        matches++;
+        b->state = PLAYING;
+    }
+    if (b->state != PLAYING) {
+        return 0;
+    }
+
+    if (f[0] >= FR_MATCH_OVER && f[0] <= FR_MATCH_OVER_LAST) {
+        if (b->move_at) {
+            hist_add(&turn_hist, now - b->move_at);
+            turns++;
+        }
+        bot_reconnect(b);
+        return 1;
+    }
+    if (f[1] & FRF_TURN) {
+        if (b->move_at) {
+            hist_add(&turn_hist, now - b->move_at);
+            turns++;
+        }
+        bot_move_binary(b, f[1]);
+    } else if ((f[1] & FRF_WAIT) && b->move_at) {
+        hist_add(&turn_hist, now - b->move_at);
+        turns++;
+        b->move_at = 0;
+    }
+    return 0;
+}
+
+/* Consume every complete frame in b's buffer, first skipping the text
+ * prompt that precedes the server's FR_HELLO.
+ * returns 1 if the bot reconnected
+ */
+static int bot_frames(struct bot *b) {
+    unsigned char *t = (unsigned char *)b->text;
+    int start = 0;
+
+    if (b->idle) {
+        // Never negotiates, so all it gets is text; ignore it
+        b->tlen = 0;
+        b->state = LOBBY;
+        return 0;
+    }
+    if (b->state == NAMING) {
+        if (!b->hello_sent) {
+            send_bytes(b, PROTO_HELLO, PROTO_HELLO_LEN);
+            b->hello_sent = 1;
+        }
+        while (start < b->tlen && t[start] != FR_HELLO) {
+            start++;
+        }
+    }
+    while (b->tlen - start >= FR_HEADER && b->tlen - start >= FR_HEADER + t[start + 6]) {
+        int len = FR_HEADER + t[start + 6];
+        if (bot_frame(b, t + start)) {
+            return 1;
+        }
+        start += len;
+    }
+    b->tlen -= start;
+    memmove(b->text, b->text + start, b->tlen);
+    return 0;
+}
+
+static char *last_match(char *text, const char *what) {
+    char *hit = NULL, *p = text;
+    while ((p = strstr(p, what)) != NULL) {
+        hit = p++;
+    }
+    return hit;
+}
+
+/* React to whatever the server has said since the last prompt. */
+static void bot_parse(struct bot *b) {
+    uint64_t now = now_ns();
+    char name[64];
+
+    if (b->state == NAMING) {
+        if (strstr(b->text, "enter your name:") == NULL) {
+            return;
+        }
+        b->tlen = 0;
+        if (b->idle) {
+            b->state = LOBBY;
+            return;
+        }
+        snprintf(name, sizeof(name), "bot%d_%d\n", b->id, b->gen);
+        send_line(b, name);
+        b->joined_at = now;
+        b->state = LOBBY;
+        return;
+    }
+
+    if (b->state == LOBBY && !b->idle && strstr(b->text, "is already in the Arena") != NULL) {
+        b->tlen = 0;
+        b->gen++;
+        snprintf(name, sizeof(name), "bot%d_%d\n", b->id, b->gen);
+        send_line(b, name);
+        return;
+    }
+
+    if (b->state == LOBBY) {
+        if (b->idle || strstr(b->text, "You engage") == NULL) {
+            return;
+        }
+        hist_add(&join_hist, now - b->joined_at);
+        matches++;
+        b->state = PLAYING;
+    }
+
+    if (strstr(b->text, "Awaiting next opponent") != NULL) {
+        if (b->move_at) {
+            hist_add(&turn_hist, now - b->move_at);
+            turns++;
+        }
+        bot_reconnect(b);
+        return;
+    }
+
+    char *turn = last_match(b->text, "It's your turn:");
+    char *wait = last_match(b->text, "Waiting for");
+    int prompt_done = b->tlen > 0 && b->text[b->tlen - 1] == '\n';
+
+    if (turn != NULL && (wait == NULL || turn > wait) && prompt_done) {
+        if (b->move_at) {
+            hist_add(&turn_hist, now - b->move_at);
+            turns++;
+        }
+        bot_move(b);
+        b->tlen = 0;
+    } else if (wait != NULL && b->move_at) {
+        hist_add(&turn_hist, now - b->move_at);
+        turns++;
+        b->move_at = 0;
+        b->tlen = 0;
+    }
+}
+
+static void bot_read(struct bot *b) {
+    while (1) {
+        if (b->tlen == TEXT_SIZE - 1 && binary) {
+            // Frames are never cut; make room by handling them now
+            if (bot_frames(b)) {
+                return;
+            }
+        } else if (b->tlen == TEXT_SIZE - 1) {
+            // Keep the tail; prompts are far shorter than the buffer
+            memmove(b->text, b->text + TEXT_SIZE / 2, TEXT_SIZE / 2 - 1);
+            b->tlen = TEXT_SIZE / 2 - 1;
+        }
+        int len = read(b->fd, b->text + b->tlen, TEXT_SIZE - 1 - b->tlen);
+        if (len > 0) {
+            bytes_in += len;
+            b->tlen += len;
+            b->text[b->tlen] = '\0';
+            continue;
+        }
+        if (len == -1 && errno == EINTR) {
+            continue;
+        }
+        if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        // Server closed us (or refused the connection): start over
+        if (b->state == CONNECTING || len == -1) {
+            connect_errors++;
+        }
+        bot_reconnect(b);
+        return;
+    }
+
+    if (b->state == CONNECTING) {
+        // The first bytes are the prompt: the server has accepted us
+        b->state = NAMING;
+        last_connect = now_ns();
+        hist_add(&connect_hist, last_connect - b->connect_at);
+        connects++;
+    }
+    if (binary) {
+        if (bot_frames(b)) {
+            return;
+        }
+    } else {
+        bot_parse(b);
+    }
+    if (b->broken) {
+        bot_reconnect(b);
+    }
+}
+
+int main(int argc, char **argv) {
+    int conns = 100, idle = 0, seconds = 10, port = PORT, stats_port = -1, opt;
+    const char *host = "127.0.0.1";
+
+    while ((opt = getopt(argc, argv, "c:i:d:p:H:bs:")) != -1) {
+        switch (opt) {
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'i':
+            idle = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'H':
+            host = optarg;
+            break;
+        case 'b':
+            binary = 1;
+            break;
+        case 's':
+            stats_port = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c playing_conns] [-i idle_conns] [-d seconds] [-p port] [-H host] [-b]"
+                    " [-s stats_port]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    srand(time(NULL));
+
+    memset(&server, '\0', sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+        fprintf(stderr, "%s: bad address %s\n", argv[0], host);
+        exit(1);
+    }
+    if (stats_port == -1) {
+        stats_port = port + 1;
+    }
+    long long syscalls_start = server_stat(stats_port, "io_syscalls");
+    long long rss_start = server_stat(stats_port, "mem_rss_bytes");
+
+    if ((epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    struct bot *bots = calloc(conns + idle, sizeof(struct bot));
+    if (!bots) {
+        perror("calloc");
+        exit(1);
+    }
+    uint64_t first_connect = now_ns();
+    for (int i = 0; i < conns + idle; i++) {
+        bots[i].id = i;
+        bots[i].idle = i >= conns;
+        bot_connect(&bots[i]);
+    }
+
+    struct epoll_event events[MAXEVENTS];
+    uint64_t start = now_ns(), end = start + (uint64_t)seconds * 1000000000;
+    uint64_t next_report = start + 1000000000, last_turns = 0;
+
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= end) {
+            break;
+        }
+        if (now >= next_report) {
+            printf("%3llus  %8llu turns/s  %6llu matches\n",
+                   (unsigned long long)((now - start) / 1000000000),
+                   (unsigned long long)(turns - last_turns), (unsigned long long)matches);
+            fflush(stdout);
+            last_turns = turns;
+            next_report += 1000000000;
+        }
+
+        int nready = epoll_wait(epfd, events, MAXEVENTS, 100);
+        for (int i = 0; i < nready; i++) {
+            bot_read(events[i].data.ptr);
+        }
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    long long syscalls_end = server_stat(stats_port, "io_syscalls");
+    long long rss_end = server_stat(stats_port, "mem_rss_bytes");
+    printf("\n%d playing + %d idle connections, %.1fs\n", conns, idle, elapsed);
+    hist_print("connect", &connect_hist);
+    hist_print("join-to-match", &join_hist);
+    hist_print("turn rtt", &turn_hist);
+    printf("turns/sec      %.0f\n", turns / elapsed);
+    printf("bytes/turn     %.0f\n", turns ? (double)bytes_in / turns : 0.0);
+    if (syscalls_start >= 0 && syscalls_end >= 0) {
+        printf("syscalls/turn  %.2f (server)\n", turns ? (double)(syscalls_end - syscalls_start) / turns : 0.0);
+    }
+    if (conns == 0 && connects > 0 && rss_start >= 0 && rss_end >= 0) {
+        printf("bytes/idle     %.0f (server resident memory, %.1f MB for %llu connections)\n",
+               (double)(rss_end - rss_start) / connects, (rss_end - rss_start) / 1e6,
+               (unsigned long long)connects);
+    }
+    double connecting = (last_connect - first_connect) / 1e9;
+    printf("connects/sec   %.0f (%llu in %.3fs)\n", connects ? connects / connecting : 0.0,
+           (unsigned long long)connects, connects ? connecting : 0.0);
+    printf("reconnects     %llu (%llu failed)\n",
+           (unsigned long long)reconnects, (unsigned long long)connect_errors);
+    return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * The rules of a match, with no sockets, text or clocks in them. Shared
+ * by the server and the simulator.
+ *
+ * Each player in a match is a struct fighter. fight_start() sets up a
+ * new match between two of them; after that every move goes through
+ * fight_move(), which applies it and reports what happened as a
+ * struct fight_result. The caller turns results into screens, timers
+ * and the end of the match.
+ *
+ * Randomness comes from the caller's struct rng, so a match replays
+ * exactly from the same seed and threads need no shared generator.
+ */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdint.h>
+
+# define FIGHT_HITPOINTS 30
+# define ATTACK_DAMAGE 5
+# define POWER_DAMAGE 15
+# define POWER_CHANCE 40          // percent of powermoves that hit
+# define POWER_MOVES_MAX 3        // a match grants 1 to this many powermoves
+# define SPEAK_LIMIT 3            // speeches per turn
+
+/* splitmix64: a 64-bit state, one add and three multiply-xorshifts a
+ * number, and every seed is as good as any other.
+ */
+struct rng {
+    uint64_t state;
+};
+
+static inline void rng_seed(struct rng *r, uint64_t seed) {
+    r->state = seed;
+}
+
+static inline uint64_t rng_next(struct rng *r) {
+    uint64_t z = (r->state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* A number from 0 to n - 1, by multiplying rather than dividing. */
+static inline uint32_t rng_below(struct rng *r, uint32_t n) {
+    return (uint32_t)(((rng_next(r) >> 32) * n) >> 32);
+}
+
+struct fighter {
+    int hitpoints;
+    int power_moves;
+    int is_turn;
+    int speak_count;              // speeches this turn, SPEAK_LIMIT + 1 once refused
+    int muted;                    // opponents may not speak; kept between matches
+};
+
+enum fight_move { FM_ATTACK, FM_POWERMOVE, FM_SPEAK, FM_MUTE };
+
+enum fight_event {
+    FE_NONE,                      // not allowed now; nothing changed
+    FE_HIT,                       // the four below end the turn
+    FE_POWER_HIT,
+    FE_POWER_MISS,
+    FE_SPEAK,                     // the mover may say something
+    FE_NO_SPEAK,                  // the opponent has muted chat
+    FE_SPOKEN_ENOUGH,
+    FE_MUTED,
+    FE_UNMUTED,
+};
+
+struct fight_result {
+    enum fight_event event;
+    int damage;
+    int won;                      // the opponent is down to 0 hitpoints
+};
+
+/* Fresh hitpoints and powermoves, and nobody's turn. */
+static inline void fight_reset(struct fighter *f, struct rng *r) {
+    f->hitpoints = FIGHT_HITPOINTS;
+    f->power_moves = rng_below(r, POWER_MOVES_MAX) + 1;
+    f->is_turn = 0;
+    f->speak_count = 0;
+}
+
+/* Begin a match between a and b, picking who moves first. */
+static inline void fight_start(struct fighter *a, struct fighter *b, struct rng *r) {
+    fight_reset(a, r);
+    fight_reset(b, r);
+    if (rng_below(r, 2) == 0) {
+        a->is_turn = 1;
+    } else {
+        b->is_turn = 1;
+    }
+}
+
+/* Whether me may start a speech against opp this turn. */
+static inline int fight_can_speak(const struct fighter *me, const struct fighter *opp) {
+    return me->speak_count < SPEAK_LIMIT && !opp->muted;
+}
+
+static inline int fight_ends_turn(enum fight_event e) {
+    return e == FE_HIT || e == FE_POWER_HIT || e == FE_POWER_MISS;
+}
+
+/* Apply one move by me against opp. Out of turn only muting is allowed.
+ * An attack or powermove hands the turn over.
+ */
+static inline struct fight_result fight_move(struct fighter *me, struct fighter *opp,
+                                             enum fight_move move, struct rng *r) {
+    struct fight_result res = { FE_NONE, 0, 0 };
+
+    if (move == FM_MUTE) {
+        me->muted = !me->muted;
+        res.event = me->muted ? FE_MUTED : FE_UNMUTED;
+        return res;
+    }
+    if (!me->is_turn) {
+        return res;
+    }
+
+    switch (move) {
+    case FM_SPEAK:
+        if (opp->muted) {
+            res.event = FE_NO_SPEAK;
+        } else if (me->speak_count == SPEAK_LIMIT) {
+            me->speak_count++;
+            res.event = FE_SPOKEN_ENOUGH;
+        } else if (me->speak_count < SPEAK_LIMIT) {
+            me->speak_count++;
+            res.event = FE_SPEAK;
+        }
+        return res;
+    case FM_ATTACK:
+        res.event = FE_HIT;
+        res.damage = ATTACK_DAMAGE;
+        break;
+    case FM_POWERMOVE:
+        if (me->power_moves == 0) {
+            return res;
+        }
+        me->power_moves--;
+        if (rng_below(r, 100) < POWER_CHANCE) {
+            res.event = FE_POWER_HIT;
+            res.damage = POWER_DAMAGE;
+        } else {
+            res.event = FE_POWER_MISS;
+        }
+        break;
+    default:
+        return res;
+    }
+
+    opp->hitpoints = opp->hitpoints > res.damage ? opp->hitpoints - res.damage : 0;
+    me->is_turn = 0;
+    me->speak_count = 0;
+    opp->is_turn = 1;
+    res.won = opp->hitpoints == 0;
+    return res;
+}
+
+#endif
@@ -7,6 +7,7 @@
  * _or_ for a new connection.
 */
 
+#define _GNU_SOURCE    // accept4()
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -15,730 +16,5106 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <poll.h>
+
+#if !defined(NO_URING) && __has_include(<linux/io_uring.h>)
+    #define HAVE_URING 1
+    #include <linux/io_uring.h>
+    #include <sys/syscall.h>
+#endif
+
+#include "engine.h"
+#include "hist.h"
+#include "proto.h"
 
 #ifndef PORT
     #define PORT 51360
 #endif
 
 # define SECONDS 10
+# define MAXEVENTS 256
+# define CLIENT_SLAB 256   // client records carved per slab allocation
+# define OUTSEG_SLAB 1024  // output queue entries carved per slab allocation
+# define MATCH_SLAB 256    // match records carved per slab allocation
+# define SEAT_SLAB 256     // seat records carved per slab allocation
+# define OUT_IOV 64        // output segments gathered per writev()
+# define RBUF_SIZE 256     // longest input line; longer lines are cut
+# define RBUF_SLAB 64      // input buffers carved per slab allocation
+# define SPEECH_MAX 100    // longest chat line, terminator included
 
-struct client {
+# define MAXSHARDS 64
+# define UPGRADE_MAGIC 0x32555241   // "ARU2", starts a hot upgrade stream
+# define UPGRADE_ENV "ARENA_UPGRADE_FD"
+# define UPGRADE_FD 3               // where the new process finds the stream
+# define UPGRADE_FDS 250            // descriptors per SCM_RIGHTS message
+# define UPGRADE_TIMEOUT_MS 5000    // for the new process to take everything over
+# define STATS_BUF 8192    // rendered size of a stats report
+# define LOG_SLOTS 4096    // log ring capacity, a power of two
+# define LOG_LINE 200      // longest log message; longer ones are cut
+# define LOG_RATE 2000     // log lines per second each thread may emit
+# define LOG_BURST 500
+
+# define TICK_MS 100       // timer wheel resolution
+# define WHEEL_BITS 6
+# define WHEEL_SLOTS (1 << WHEEL_BITS)
+# define WHEEL_LEVELS 4    // 64^4 ticks, about 19 days
+
+# define URING_ENTRIES 256 // io_uring submission queue size
+# define UBUF_COUNT 1024   // provided receive buffers, a power of two
+# define UBUF_SIZE 512
+
+#ifndef LISTEN_BACKLOG
+    #define LISTEN_BACKLOG SOMAXCONN   // pending connections per shard; the kernel caps it at net.core.somaxconn
+#endif
+
+# define BOARD_SIZE 5          // leaderboard rows
+# define PROFILE_SLAB 1024     // profiles carved per slab allocation
+# define PROFILE_FLUSH_MS 1000 // how often match results are written to the log
+# define PROFILE_MAGIC 0x32505241  // "ARP2", starts every profile file and log record
+# define RATING_START 1500     // Elo rating of a new player
+# define RATING_K 32           // most rating points one match can move
+# define RATING_BUCKET 50      // rating points per waiting index bucket
+# define RATING_BUCKETS 64     // one bit each in bucket_mask
+#ifndef MATCH_WINDOW
+    #define MATCH_WINDOW 100   // rating gap a new waiter accepts
+#endif
+#ifndef MATCH_WIDEN
+    #define MATCH_WIDEN 50     // extra gap accepted per second of waiting
+#endif
+# define MATCH_RETRY_MS 500    // rematching interval while windows widen
+# define ACCEPT_RETRY_MS 100   // pause before accepting again after accept() ran out of resources
+#ifndef SNAPSHOT_EVERY
+    #define SNAPSHOT_EVERY 10000   // logged results between profile snapshots
+#endif
+
+#ifndef IP_CONNS
+    #define IP_CONNS 32        // connections one address may hold open
+#endif
+#ifndef LINE_RATE
+    #define LINE_RATE 20       // input lines per second from one address
+#endif
+# define LINE_BURST_SECS 2     // seconds of lines an address may save up
+#ifndef CHAT_RATE
+    #define CHAT_RATE 30       // chat lines per minute from one address
+#endif
+# define CHAT_BURST 5
+# define IP_BITS 16            // address index buckets, 1 << IP_BITS
+# define IP_LOCKS 64           // bucket lock stripes, a power of two
+
+#ifndef NAME_TIMEOUT
+    #define NAME_TIMEOUT 60    // seconds to answer the name prompt
+#endif
+#ifndef TURN_TIMEOUT
+    #define TURN_TIMEOUT 60    // seconds to make a move
+#endif
+#ifndef IDLE_TIMEOUT
+    #define IDLE_TIMEOUT 600   // seconds a named client may sit in the lobby silently
+#endif
+
+enum loglevel { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+/* What a log line is about, so the log can be filtered by event. */
+enum logevent { EV_SERVER, EV_JOIN, EV_LEAVE, EV_MATCH_START, EV_MATCH_END, EV_SLOW, EV_TIMEOUT, EV_ERROR };
+
+/* One log ring entry. seq says whose turn the slot is: a producer may
+ * fill it when seq equals its ticket, the writer may drain it when seq
+ * is the ticket plus one.
+ */
+struct logslot {
+    _Atomic size_t seq;
+    struct timespec when;
+    enum loglevel level;
+    enum logevent event;
+    char text[LOG_LINE];
+};
+
+#ifndef OUTQ_HIGHWATER
+    #define OUTQ_HIGHWATER 65536   // queued output bytes before a client is dropped
+#endif
+#ifndef SPECTATOR_HIGHWATER
+    #define SPECTATOR_HIGHWATER 16384  // queued output bytes before a spectator stops watching
+#endif
+
+/* A rendered message. Broadcasts share one msgbuf between every
+ * recipient's queue, so it is freed when the last reference goes.
+ */
+struct msgbuf {
+    int refs;
+    size_t len;
+    char data[];
+};
+
+/* A match in progress, shared by its two players. Spectators hang off
+ * it, so each event is rendered once however many are watching.
+ */
+struct match {
+    struct client *watchers;
+    struct match *next_free;
+};
+
+/* What a client needs for matchmaking, a match or spectating. Only
+ * clients that are queued, playing, watching or challenging someone
+ * have one; it comes from the shard's pool and goes back when none of
+ * those hold any more, see seat_attach() and seat_release().
+ */
+struct seat {
+    uint64_t wait_since;         // When it joined the waiting queue
+    struct client *wait_next;    // Neighbours in the waiting queue
+    struct client *wait_prev;
+    struct client *bucket_next;  // Neighbours in the waiting index bucket
+    struct client *bucket_prev;
+    struct match *watching;      // Match this lobby client spectates, or NULL
+    struct client *watch_next;   // Neighbours among that match's spectators
+    struct client *watch_prev;
+    char challenged[50];         // Player this lobby client has challenged, or ""
+    struct fighter fight;        // Hitpoints and moves, see engine.h
+    struct match *match;         // Shared with the opponent while in_game
+    struct client *opponent;     // Current opponent in an ongoing match
+    struct client *last_opponent; // Most recent opponent after a match ends
+    struct seat *next_free;
+};
+
+/* A timer on the shard's wheel, embedded in whatever it times. */
+struct timer {
+    struct timer *next;
+    struct timer **pprev;        // NULL while not armed
+    uint64_t expires;            // wheel tick it fires on
+};
+
+/* What a client's timer is currently counting down to. */
+enum timeout { TO_NONE, TO_NAME, TO_TURN, TO_IDLE };
+
+/* Everything the game says is rendered from one of these templates. */
+enum tplid {
+    T_PROMPT, T_HELLO, T_WELCOME, T_JOINS, T_LEFT, T_FORFEIT, T_VICTORY, T_DEFEAT,
+    T_ENGAGE, T_HIT, T_MISS, T_GOT_HIT, T_GOT_POWER, T_GOT_MISS,
+    T_SPOKE, T_TOLD, T_SPEAK, T_MUTED, T_UNMUTED, T_NO_SPEAK, T_SPOKEN_ENOUGH,
+    T_STATUS, T_STATUS_NOPM, T_WAIT,
+    T_MENU, T_MENU_NOPM, T_MENU_NOSPEAK, T_MENU_NOPM_NOSPEAK,
+    T_TIMED_OUT, T_OPP_TIMED_OUT,
+    T_WATCHING, T_UNWATCHED, T_NO_MATCH, T_TOO_FAST,
+    T_NAME_TAKEN, T_NOT_HERE, T_BUSY, T_CHALLENGE, T_CHALLENGED, T_UNCHALLENGED,
+    T_WHISPER, T_WHISPERED, T_WHISPER_MUTED, T_WHISPER_BINARY, T_WHISPER_SELF, T_SLOW_DOWN,
+    T_SEE_HIT, T_SEE_POWER, T_SEE_MISS, T_SEE_TOLD, T_SEE_WON,
+    T_COUNT
+};
+
+/* Values a template can refer to. Slots before SL_HP are strings, the
+ * rest are integers.
+ */
+enum slot { SL_NAME, SL_OPP, SL_TEXT, SL_HP, SL_PM, SL_OPP_HP, SL_DMG, SL_COUNT };
+
+union slotval {
+    const char *s;
+    int n;
+};
+
+# define TPL_SEGS 12       // literal runs and slots in one template
+# define INT_CHARS 11      // longest rendered int, sign included
+
+/* A template compiled into literal runs and the slots between them. */
+struct tpl {
+    int nseg;
+    size_t lit_len;              // literal bytes, for sizing the output
+    int nint;                    // integer slots
+    struct {
+        const char *lit;         // literal run, or NULL for a slot
+        int len;
+        enum slot slot;
+    } seg[TPL_SEGS];
+};
+
+# define SCR_STATUS 1      // follow the header with the viewer's hitpoints
+# define SCR_MENU 2        // then the move menu
+# define SCR_WAIT 4        // or the line saying whose move it is
+
+/* A player's record, kept for as long as the server runs. */
+struct profile {
+    struct profile *hnext;       // next in the hash chain
+    char name[50];
+    uint32_t wins;
+    uint32_t losses;
+    int rating;
+    int rank;                    // row on the leaderboard, -1 if not on it
+    int online;                  // a connected client goes by this name
+    struct shard *home;          // shard whose client that is, NULL while moving
+    struct client *client;       // only for the home shard to follow
+};
+
+/* On-disk profile formats: the log is a log_header and then one
+ * result_rec per match; the snapshot a snap_header and one snap_rec per
+ * profile.
+ */
+struct log_header {
+    uint32_t magic;
+    uint64_t gen;                // snapshot generation the log continues
+};
+
+struct result_rec {
+    uint32_t magic;
+    char winner[50];
+    char loser[50];
+};
+
+struct snap_header {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t gen;
+};
+
+struct snap_rec {
+    char name[50];
+    uint32_t wins;
+    uint32_t losses;
+    int32_t rating;
+};
+
+/* A source address with connections open. Every shard shares the
+ * index of them, so the caps hold however the kernel spreads one
+ * host's connections.
+ */
+struct ipentry {
+    struct ipentry *next;        // next in the hash chain
+    uint32_t addr;               // network byte order
+    int conns;
+    double line_tokens;          // token buckets, refilled on use
+    double chat_tokens;
+    uint64_t refill;             // when the buckets were last topped up
+};
+
+/* One entry in a client's output queue. */
+struct outseg {
+    struct outseg *next;
+    struct msgbuf *m;
+};
+
+/* A waiting client being moved to another shard. Only plain data
+ * crosses threads; the receiving shard builds a fresh struct client.
+ */
+struct handoff {
+    struct handoff *next;
     int fd;
     struct in_addr ipaddr;
+    struct ipentry *ip;
     char name[50];
-    struct client *next;
-    struct client *opponent;     // Current opponent in an ongoing match
-    struct client *last_opponent; // Most recent opponent after a match ends
-    int in_game;
-    int hitpoints;
-    int power_moves;
-    int is_turn;
-    int name_set;
-    int speaking;
-    char speak_buffer[100];
-    int speak_count;
     int mute_toggle;
+    int binary;
+    struct profile *profile;
+    int rating;
+    char rbuf[RBUF_SIZE];
+    int rlen;
+    int rskip;
+};
+
+/* Per-shard instrumentation. Only the owning shard writes these, with
+ * relaxed stores; the stats endpoint sums them across shards.
+ */
+struct stats {
+    uint64_t accepted;           // counters
+    uint64_t closed;
+    uint64_t matches_started;
+    uint64_t matches_ended;
+    uint64_t moves_attack;
+    uint64_t moves_powermove;
+    uint64_t moves_speak;
+    uint64_t moves_mute;
+    uint64_t sends_dropped;
+    uint64_t slow_consumers;
+    uint64_t spectators_shed;
+    uint64_t handoffs;
+    uint64_t shed;               // connections refused for lack of descriptors
+    uint64_t refused_ip;         // connections over their address's cap
+    uint64_t lines_limited;      // input lines dropped by rate limiting
+    uint64_t chat_limited;
+    uint64_t timeouts_name;
+    uint64_t timeouts_turn;
+    uint64_t timeouts_idle;
+    uint64_t syscalls;           // socket and event loop system calls
+    uint64_t clients;            // gauges
+    uint64_t waiting;
+    uint64_t spectators;
+    struct hist handle_ns;       // handleclient() processing time
+    struct hist match_ns;        // one matchmaking pass
+    struct hist match_wait_ns;   // time from joining the queue to a match
+    struct hist match_gap;       // rating difference of each pairing
+    struct hist loop_ns;         // one event loop iteration
+};
+
+/* A shard's part of a hot upgrade: its records and descriptors, packed
+ * by the old process or received by the new one.
+ */
+struct upbuf {
+    char *data;
+    size_t len, cap;
+    int *fds;
+    size_t nfds, fdcap;
+};
+
+/* One event-loop worker. Each shard owns its listening socket, its
+ * clients and their matches; the only shared state is the inbox other
+ * shards push handoffs onto, and the eventfd that wakes it up.
+ */
+struct shard {
+    int id;
+    pthread_t thread;
+    int evfd;
+    _Atomic(struct handoff *) inbox;
+    struct upbuf up;
+    struct stats stats;
+} __attribute__((aligned(64)));
+
+/* Hot upgrade stream: an upgrade_header, then the descriptors in
+ * batches of UPGRADE_FDS, then for each shard an upgrade_shard and its
+ * clients, each an upgrade_rec followed by its unframed input and its
+ * unsent output, and last, without -P, nprofiles snap_recs. Descriptors
+ * go shard by shard: the listening socket, the stats socket if the
+ * shard has it, then one per client.
+ */
+struct upgrade_header {
+    uint32_t magic;
+    uint32_t nshards;
+    uint32_t nfds;
+    uint32_t nprofiles;
+    uint64_t len;                // bytes of shard records
+};
+
+struct upgrade_shard {
+    uint32_t nclients;
+    uint32_t has_stats;
+};
+
+struct upgrade_rec {
+    char name[50];
+    uint32_t ipaddr;
+    int32_t opponent;            // record index in the same shard, or -1
+    int32_t last_opponent;
+    int32_t watching;            // a player in the match being watched, or -1
+    char challenged[50];         // name this lobby client has challenged, or ""
+    int32_t name_set, in_game, speaking, binary, waiting;
+    int32_t hitpoints, power_moves, is_turn, speak_count, muted;
+    int32_t rlen, rskip;
+    uint32_t out_len;
+    uint64_t waited_ms;
+};
+
+/* A connection. Everything an idle socket needs comes first and is
+ * kept small, since most clients sit at the name prompt or in the
+ * lobby; the input buffer is only attached while a partial line is
+ * pending, and the seat only while queued, playing or watching.
+ */
+struct client {
+    int fd;
+    struct in_addr ipaddr;
+    struct ipentry *ip;          // Shared limits for ipaddr, NULL if exempt
+    struct client *next;
+    struct client *prev;         // Previous client; the dummy head's prev is the last client
+    char name[50];
+    unsigned name_set : 1;
+    unsigned in_game : 1;
+    unsigned speaking : 1;
+    unsigned waiting : 1;        // Queued for matchmaking
+    unsigned out_blocked : 1;    // Last write hit EAGAIN, waiting for EPOLLOUT
+    unsigned flush_pending : 1;  // On the flush list
+    unsigned dead : 1;           // Marked for removal at the end of the loop
+    unsigned rskip : 1;          // Discarding the tail of an overlong line
+    unsigned binary : 1;         // Speaks the binary protocol from proto.h
+    unsigned zombie : 1;         // Removed, freed by the last io_uring completion
+    unsigned muted : 1;          // Opponents may not speak; kept between matches
+    enum timeout timeout;        // What timer is armed for
+    int rlen;
+    char *rbuf;                  // Received bytes not yet framed into lines, or NULL
+    struct timer timer;
+    struct outseg *out_head;     // Output not yet accepted by the socket
+    struct outseg *out_tail;
+    size_t out_off;              // Bytes of out_head already written
+    size_t out_bytes;            // Total bytes queued
+    struct client *flush_next;
+    struct client *flush_prev;
+    struct client *dead_next;
+    int inflight;                // io_uring requests still pointing at this record
+    int rating;                  // This shard's copy of the profile's rating
+    struct sendreq *sendreq;     // io_uring send in flight
+    struct shard *migrate_to;    // Handoff waiting for the receive to be cancelled
+    struct profile *profile;     // Wins and losses under this name, once named
+    int index;                   // Position in a hot upgrade stream
+    struct seat *seat;           // Queue, match and spectator state, or NULL
 };
 static struct client *addclient(struct client *top, int fd, struct in_addr addr);
 static struct client *removeclient(struct client *top, int fd);
 //static void broadcast(struct client *top, char *s, int size);
-static void broadcast(struct client *top, char *s, int size, int exclude_fd);
+static void broadcast(struct client *top, struct client *subject, enum tplid header);
 int handleclient(struct client *p, struct client *top);
+static void processline(struct client *p, struct client *top, char *line);
+static void frame_lines(struct client *p, struct client *top);
+static void frame_binary(struct client *p, struct client *top);
+static void speak_frame(struct client *p, struct client *top, char *text);
+static void say(struct client *p, const char *line);
+static void rbuf_open(struct client *p);
+static void rbuf_close(struct client *p);
+static char *rbuf_alloc(void);
+static void rbuf_free(char *b);
 void end_match(struct client **top, struct client *p1, struct client *p2);
-static struct client *match_opponent(struct client *top, struct client *current);
+static struct client *match_opponent(struct client *current, uint64_t now);
+static void enqueue_waiting(struct client *p);
+static void dequeue_waiting(struct client *p);
+static void queue_msgbuf(struct client *p, struct msgbuf *m);
+static struct msgbuf *msgbuf_alloc(size_t size);
+static void msgbuf_put(struct msgbuf *m);
+static void tpl_init(void);
+static struct msgbuf *render_screen(struct client *p, enum tplid header, int flags, int dmg, const char *text);
+static void send_screen(struct client *p, enum tplid header, int flags, int dmg, const char *text);
+static void send_about(struct client *viewer, struct client *subject, enum tplid header, int dmg, const char *text);
+static void outseg_free(struct outseg *seg);
+static void flush_client(struct client *p);
+static void flush_output(void);
+static void unlink_flush(struct client *p);
+static void kill_client(struct client *p);
+static void reap_clients(struct client *top);
+static void disconnect_client(struct client *p, struct client *top);
 void start_battle(struct client *p1, struct client *p2);
+static void watch_command(struct client *p, const char *name);
+static void challenge_command(struct client *p, const char *name);
+static void whisper_command(struct client *p, char *args);
+static void unwatch(struct client *p);
+static struct seat *seat_attach(struct client *p);
+static void seat_release(struct client *p);
+static void seat_free(struct seat *s);
+static void spectate(struct client *subject, enum tplid header, int dmg, const char *text);
+static void match_over(struct client *winner);
 void move_client_end(struct client **top, struct client *move);
 
 
 int bindandlisten(void);
+static void *run_shard(void *arg);
+static void epoll_loop(struct client *head, int listenfd, int statsfd);
+static void epoll_events(struct client *head, struct epoll_event *events, int nready, int listenfd, int statsfd);
+static int tick_wait(void);
+static void tick_start(uint64_t start, int busy);
+static void accept_client(struct client *head, int clientfd, struct in_addr addr);
+static void accept_pending(struct client *head, int listenfd);
+static int accept_failed(int listenfd, int err);
+static int ip_admit(struct in_addr addr, int force, struct ipentry **out);
+static void ip_release(struct ipentry *e);
+static int ip_take(struct ipentry *e, int chat);
+static int watch_client(struct client *p);
+static void finish_pass(struct client *head);
+static int handoff_client(struct client *top, struct client *w, struct shard *other);
+static void out_advance(struct client *p, size_t written);
+static void client_destroy(struct client *p);
+static struct client *newclient(struct client *top, int fd, struct in_addr addr);
+static void adopt_clients(struct client *top);
+static void balance_shards(struct client *top);
+static int bindstats(int port);
+static void logmsg(enum loglevel level, enum logevent event, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+static void *run_logger(void *arg);
+static void serve_stats(int statsfd);
+static long long resident_bytes(void);
+static void timer_arm(struct timer *t, uint64_t ticks);
+static void timer_cancel(struct timer *t);
+static void run_timers(struct client *top);
+static int loop_timeout(void);
+static void update_timeout(struct client *p);
+static int profile_claim(struct client *p, const char *name, int force);
+static void profile_release(struct client *p);
+static void profile_locate(struct client *p, struct client *where);
+static struct client *find_player(const char *name);
+static void profile_record(struct client *winner, struct client *loser);
+static void send_board(struct client *p);
+static void profiles_load(void);
+static void profile_restore(const struct snap_rec *rec);
+static void *run_profiles(void *arg);
+static void upgrade_signal(int sig);
+static void upgrade_shard(struct client *head, int listenfd, int statsfd);
+static void upgrade_receive(int chan);
+static void upgrade_restore(struct client *head);
+#ifdef HAVE_URING
+static int uring_setup(void);
+static void uring_loop(struct client *head, int listenfd, int statsfd);
+static void uring_recv(struct client *p);
+static void uring_send(struct client *p);
+static void uring_cancel(struct client *p);
+#endif
 
-int main(void) {
-    srand(time(NULL));
+static size_t outq_highwater = OUTQ_HIGHWATER;
+static int listen_backlog = LISTEN_BACKLOG;
+static int nshards = 1;
+static struct shard shards[MAXSHARDS];
+static _Atomic(struct shard *) lonely;  // shard advertising a waiter nobody local can play
+static const char inbox_tag;            // epoll data for a shard's eventfd
+static const char stats_tag;            // epoll data for the stats socket
+static int stats_port = PORT + 1;
+static int name_timeout = NAME_TIMEOUT;  // seconds, 0 for no limit
+static int turn_timeout = TURN_TIMEOUT;
+static int idle_timeout = IDLE_TIMEOUT;
+static int turn_autoattack;             // attack for a player out of time instead of forfeiting
+static int want_uring;                  // drive shards with io_uring instead of epoll
+static int tick_ms;                     // -T batching interval, 0 to run a pass per wakeup
+static int ip_conns = IP_CONNS;         // per address, 0 for no limit
+static int line_rate = LINE_RATE;       // per address and second, 0 for no limit
+static struct ipentry *ip_table[1 << IP_BITS];
+static pthread_mutex_t ip_locks[IP_LOCKS];  // bucket b is under ip_locks[b % IP_LOCKS]
+static char **saved_argv;               // to exec the new binary on a hot upgrade
+static _Atomic int upgrade_pending;     // SIGUSR2 asked for a hot upgrade
+static pthread_barrier_t upgrade_barrier;
+static int upgrade_done;                // the new process has taken over
 
-    int clientfd, maxfd, nready;
-    struct client *opponent;
-    struct client *head = malloc(sizeof(struct client));  // Allocate memory for the dummy head node
-    if (head == NULL) {
-        perror("malloc");
-        exit(1);
-    }
+static const char *profile_path;        // -P file prefix, NULL to keep profiles in memory only
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t profile_io_lock = PTHREAD_MUTEX_INITIALIZER;  // held by the writer while writing
+static struct profile **profile_table;  // hash index by name
+static size_t profile_buckets;          // a power of two
+static size_t profile_count;
+static struct profile *profile_free;    // unused slab entries
+static struct profile *board[BOARD_SIZE];  // most wins first
+static int board_len;
+static _Atomic unsigned board_version;  // bumped whenever the board would read differently
+static struct result_rec *results;      // results not yet handed to the writer
+static size_t nresults, results_cap;
+static int profile_log = -1;            // the writer's log, and the state below, are its own
+static uint64_t profile_gen;
+static size_t results_logged;           // results in the log since the last snapshot
 
-    // Initialize the dummy head node
-    head->name[0] = 'S';  
-    head->name[1] = '\0';
-    head->in_game = 1;
-    head->name_set = 1;
-    head->next = NULL;  
+static enum loglevel log_level = LOG_INFO;
+static struct logslot logring[LOG_SLOTS];
+static _Atomic size_t log_head;         // next ticket handed to a producer
+static _Atomic uint64_t log_dropped;    // lines lost because the ring was full
+static _Atomic uint64_t log_suppressed; // lines held back by rate limiting
 
-    socklen_t len;
-    struct sockaddr_in q;
-    struct timeval tv;
-    fd_set allset;
-    fd_set rset;
+/* Message templates. {name} is the viewer's name and {opp} their
+ * opponent's; the rest are filled in by the caller.
+ */
+static const char *const tpl_src[T_COUNT] = {
+    [T_PROMPT] = "Welcome! Please enter your name:",
+    [T_HELLO] = "",
+    [T_WELCOME] = "\nWelcome, {name}! Awaiting opponent...\r\n",
+    [T_JOINS] = "\n*****{name} joins the Arena******\r\n",
+    [T_LEFT] = "\n*****{name} left the Arena******\r\n",
+    [T_FORFEIT] = "Opponent {opp} disconnected. You win!\nAwaiting next opponent...\r\n",
+    [T_VICTORY] = "Victory! {opp}'s hitpoints are now 0. You win!\nAwaiting next opponent...\r\n",
+    [T_DEFEAT] = "Defeat! Your hitpoints are now 0. {opp} wins!\nAwaiting next opponent...\r\n",
+    [T_ENGAGE] = "\nYou engage {opp}!\n",
+    [T_HIT] = "\nYou hit {opp} for {dmg} damage!\n",
+    [T_MISS] = "\nYou missed!\n",
+    [T_GOT_HIT] = "\n{opp} hits you for {dmg} damage!\n",
+    [T_GOT_POWER] = "\n{opp} powermoves you for {dmg} damage!\n",
+    [T_GOT_MISS] = "\n{opp}'s powermove missed!\n",
+    [T_SPOKE] = "\nYou speak: {text}\n\n",
+    [T_TOLD] = "\n\n{opp} takes a break to tell you:\n{text}\n\n",
+    [T_SPEAK] = "\nSpeak: ",
+    [T_MUTED] = "\nChat is now muted.\n\n",
+    [T_UNMUTED] = "\nChat is now unmuted.\n\n",
+    [T_NO_SPEAK] = "\nYou cannot speak with {opp}, their mute toggle is on.\n\n",
+    [T_SPOKEN_ENOUGH] = "\nYou have spoken enough! It is time to attack.\n\n",
+    [T_STATUS] = "Your hitpoints: {hp}\nYour powermoves: {pm}\n\n{opp}'s hitpoints: {opp_hp}\n",
+    [T_STATUS_NOPM] = "Your hitpoints: {hp}\n\n{opp}'s hitpoints: {opp_hp}\n",
+    [T_WAIT] = "Waiting for {opp} to strike...\n",
+    [T_MENU] = "\nIt's your turn:\n(a)ttack\n(p)owermove\n(s)peak something\n(m)ute chat\n",
+    [T_MENU_NOPM] = "\nIt's your turn:\n(a)ttack\n(s)peak something\n(m)ute chat\n",
+    [T_MENU_NOSPEAK] = "\nIt's your turn:\n(a)ttack\n(p)owermove\n(m)ute chat\n",
+    [T_MENU_NOPM_NOSPEAK] = "\nIt's your turn:\n(a)ttack\n(m)ute chat\n",
+    [T_TIMED_OUT] = "\nTime's up! You forfeit the match.\nAwaiting next opponent...\r\n",
+    [T_OPP_TIMED_OUT] = "\n{opp} ran out of time. You win!\nAwaiting next opponent...\r\n",
+    [T_WATCHING] = "\nWatching {name} ({hp} hitpoints) against {opp} ({opp_hp} hitpoints). Send w to stop.\n",
+    [T_UNWATCHED] = "\nNo longer watching.\n",
+    [T_NO_MATCH] = "\nNobody called {text} is in a match here.\n",
+    [T_TOO_FAST] = "\nYou are talking too fast. Wait a moment and speak again: ",
+    [T_NAME_TAKEN] = "\n{text} is already in the Arena. Please enter your name:",
+    [T_NOT_HERE] = "\nNobody called {text} is here.\n",
+    [T_BUSY] = "\n{text} is in a match.\n",
+    [T_CHALLENGE] = "\nYou challenge {text}.\n",
+    [T_CHALLENGED] = "\n{name} challenges you! Send c {name} to accept.\n",
+    [T_UNCHALLENGED] = "\nChallenge withdrawn.\n",
+    [T_WHISPER] = "\n{name} whispers: {text}\n",
+    [T_WHISPERED] = "\nYou whisper to {text}.\n",
+    [T_WHISPER_MUTED] = "\n{text} has chat muted.\n",
+    [T_WHISPER_BINARY] = "\n{text}'s client cannot show whispers.\n",
+    [T_WHISPER_SELF] = "\nYou cannot whisper to yourself.\n",
+    [T_SLOW_DOWN] = "\nYou are talking too fast.\n",
+    [T_SEE_HIT] = "\n>> {name} hits {opp} for {dmg} damage, {opp_hp} hitpoints left.\n",
+    [T_SEE_POWER] = "\n>> {name} powermoves {opp} for {dmg} damage, {opp_hp} hitpoints left.\n",
+    [T_SEE_MISS] = "\n>> {name}'s powermove at {opp} missed.\n",
+    [T_SEE_TOLD] = "\n>> {name} tells {opp}: {text}\n",
+    [T_SEE_WON] = "\n>> {name} beats {opp}!\n",
+};
+static const char *const slot_names[SL_COUNT] = {
+    [SL_NAME] = "name", [SL_OPP] = "opp", [SL_TEXT] = "text",
+    [SL_HP] = "hp", [SL_PM] = "pm", [SL_OPP_HP] = "opp_hp", [SL_DMG] = "dmg",
+};
+static struct tpl tpls[T_COUNT];       // compiled once by tpl_init()
+
+/* The frame a binary client gets instead of each screen, and the slot
+ * whose text rides along (SL_COUNT for none). Screens with no frame
+ * type are not sent to binary clients at all.
+ */
+static const struct {
+    unsigned char type;
+    enum slot carries;
+} tpl_frames[T_COUNT] = {
+    [T_HELLO] = { FR_HELLO, SL_COUNT },
+    [T_WELCOME] = { FR_WELCOME, SL_COUNT },
+    [T_JOINS] = { FR_JOINS, SL_NAME },
+    [T_LEFT] = { FR_LEFT, SL_NAME },
+    [T_FORFEIT] = { FR_FORFEIT, SL_COUNT },
+    [T_VICTORY] = { FR_VICTORY, SL_COUNT },
+    [T_DEFEAT] = { FR_DEFEAT, SL_COUNT },
+    [T_ENGAGE] = { FR_ENGAGE, SL_OPP },
+    [T_HIT] = { FR_HIT, SL_COUNT },
+    [T_MISS] = { FR_MISS, SL_COUNT },
+    [T_GOT_HIT] = { FR_GOT_HIT, SL_COUNT },
+    [T_GOT_POWER] = { FR_GOT_POWER, SL_COUNT },
+    [T_GOT_MISS] = { FR_GOT_MISS, SL_COUNT },
+    [T_SPOKE] = { FR_SPOKE, SL_COUNT },
+    [T_TOLD] = { FR_TOLD, SL_TEXT },
+    [T_MUTED] = { FR_MUTED, SL_COUNT },
+    [T_UNMUTED] = { FR_UNMUTED, SL_COUNT },
+    [T_NO_SPEAK] = { FR_NO_SPEAK, SL_COUNT },
+    [T_SPOKEN_ENOUGH] = { FR_SPOKEN_ENOUGH, SL_COUNT },
+    [T_TIMED_OUT] = { FR_TIMED_OUT, SL_COUNT },
+    [T_OPP_TIMED_OUT] = { FR_OPP_TIMED_OUT, SL_COUNT },
+    [T_NAME_TAKEN] = { FR_NAME_TAKEN, SL_TEXT },
+};
 
-    int listenfd = bindandlisten();
-    FD_ZERO(&allset);
-    FD_SET(listenfd, &allset);
-    maxfd = listenfd;
+/* Everything below belongs to the shard running on the current thread. */
+static __thread struct shard *self;
+static __thread struct rng rng;   // powermoves and first movers in this shard's matches
+static __thread int epfd;    // epoll instance driving the shard's loop
+static __thread int use_uring;  // or io_uring, when it could be set up
+static __thread int spare_fd = -1;  // given up to refuse connections when out of descriptors
+static __thread int shedding;       // refusing connections since the last successful accept
+static __thread uint64_t accept_retry;  // when to try the listener again after a failed accept, or 0
+static __thread int tick_busy;      // the last pass had events to handle
+static __thread uint64_t tick_next; // when tick mode lets the next busy pass start
+static __thread struct msgbuf *board_msg;   // this shard's rendering of the leaderboard
+static __thread unsigned board_msg_version;
 
-    while (1) {
-        rset = allset;
-        tv.tv_sec = SECONDS;
-        tv.tv_usec = 0;
+static __thread struct client *client_freelist;  // recycled client records
+static __thread struct client **fdtable;         // fd -> client lookup
+static __thread int fdtable_size;
 
-        nready = select(maxfd + 1, &rset, NULL, NULL, &tv);
-        if (nready == 0) {
-            printf("No response from clients in %d seconds\n", SECONDS);
-            continue;
-        }
+static __thread struct client *wait_head;        // clients awaiting an opponent, oldest first
+static __thread struct client *wait_tail;
+static __thread int queue_dirty;                 // waiting queue changed since the last matchmaking pass
+static __thread uint64_t match_retry;            // next pass to run even if nothing changed
+static __thread struct client *buckets[RATING_BUCKETS];  // waiting clients by rating, oldest first
+static __thread struct client *bucket_tails[RATING_BUCKETS];
+static __thread uint64_t bucket_mask;            // buckets with anyone in them
 
-        if (nready == -1) {
-            perror("select");
-            continue;
-        }
+static __thread struct client *flush_list;       // clients with output waiting to be written
+static __thread struct outseg *outseg_freelist;  // recycled output queue entries
+static __thread struct match *match_freelist;    // recycled match records
+static __thread struct seat *seat_freelist;      // recycled seat records
+static __thread char *rbuf_freelist;             // recycled input buffers
+static __thread char rbuf_scratch[RBUF_SIZE];    // input of clients with no partial line
+static __thread struct client *dead_list;        // clients to remove once the loop iteration ends
+
+static __thread struct timer *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static __thread uint64_t wheel_now;              // next tick to run
+static __thread int timers_armed;
 
-        if (FD_ISSET(listenfd, &rset)) {
-            len = sizeof(q);
-            if ((clientfd = accept(listenfd, (struct sockaddr *)&q, &len)) < 0) {
-                perror("accept");
+/* Bump one of the running shard's stats. */
+static inline void stat_add(uint64_t *c, int64_t n) {
+    __atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+}
+#define STAT(field, n) stat_add(&self->stats.field, (n))
+
+static __thread double log_tokens = LOG_BURST;   // logging token bucket
+static __thread uint64_t log_refill;
+
+int main(int argc, char **argv) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "q:w:s:l:n:t:ai:Ub:P:c:r:T:")) != -1) {
+        switch (opt) {
+        case 'q':
+            outq_highwater = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            nshards = atoi(optarg);
+            if (nshards < 1 || nshards > MAXSHARDS) {
+                fprintf(stderr, "%s: worker count must be between 1 and %d\n", argv[0], MAXSHARDS);
                 exit(1);
             }
-
-            // Set the socket to non-blocking mode
-            int flags = fcntl(clientfd, F_GETFL, 0);
-            if (flags == -1) {
-                perror("fcntl");
-                close(clientfd); // Handle error appropriately
-        } else {
-                if (fcntl(clientfd, F_SETFL, flags | O_NONBLOCK) == -1) {
-                    perror("fcntl");
-                    close(clientfd); // Handle error appropriately
+            break;
+        case 's':
+            stats_port = atoi(optarg);
+            break;
+        case 'l':
+            if (!strcmp(optarg, "debug")) {
+                log_level = LOG_DEBUG;
+            } else if (!strcmp(optarg, "info")) {
+                log_level = LOG_INFO;
+            } else if (!strcmp(optarg, "warn")) {
+                log_level = LOG_WARN;
+            } else if (!strcmp(optarg, "error")) {
+                log_level = LOG_ERROR;
+            } else {
+                fprintf(stderr, "%s: log level must be debug, info, warn or error\n", argv[0]);
+                exit(1);
             }
+            break;
+        case 'n':
+            name_timeout = atoi(optarg);
+            break;
+        case 't':
+            turn_timeout = atoi(optarg);
+            break;
+        case 'a':
+            turn_autoattack = 1;
+            break;
+        case 'i':
+            idle_timeout = atoi(optarg);
+            break;
+        case 'U':
+            want_uring = 1;
+            break;
+        case 'b':
+            listen_backlog = atoi(optarg);
+            break;
+        case 'P':
+            profile_path = optarg;
+            break;
+        case 'c':
+            ip_conns = atoi(optarg);
+            break;
+        case 'r':
+            line_rate = atoi(optarg);
+            break;
+        case 'T':
+            tick_ms = atoi(optarg);
+            if (tick_ms < 0 || tick_ms > 1000) {
+                fprintf(stderr, "%s: tick must be between 0 and 1000 ms\n", argv[0]);
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-q output_queue_highwater] [-w workers] [-s stats_port] [-l log_level]"
+                    " [-n name_timeout] [-t turn_timeout] [-a] [-i idle_timeout] [-U] [-b backlog]"
+                    " [-P profile_file] [-c conns_per_ip] [-r lines_per_sec] [-T tick_ms]\n", argv[0]);
+            exit(1);
         }
-
-        FD_SET(clientfd, &allset);
-        if (clientfd > maxfd) {
-            maxfd = clientfd;
-        }
-        addclient(head, clientfd, q.sin_addr);
     }
 
-        struct client *p = head->next;
-        struct client *next = NULL;
+    // Writes to a client that has hung up must fail with EPIPE, not kill us
+    signal(SIGPIPE, SIG_IGN);
+    saved_argv = argv;
+    tpl_init();
+    for (int i = 0; i < IP_LOCKS; i++) {
+        pthread_mutex_init(&ip_locks[i], NULL);
+    }
 
-        while (p != NULL) {
-            next = p->next;
+    for (size_t i = 0; i < LOG_SLOTS; i++) {
+        atomic_init(&logring[i].seq, i);
+    }
+    pthread_t logger;
+    if (pthread_create(&logger, NULL, run_logger, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
 
-            if (FD_ISSET(p->fd, &rset)) {
-                int result = handleclient(p, head);
-                if (result == -1) {
-                    FD_CLR(p->fd, &allset);
-                    close(p->fd);
-                    head = removeclient(head, p->fd);
-            }
+    if (profile_path != NULL) {
+        profiles_load();
+        pthread_t writer;
+        if (pthread_create(&writer, NULL, run_profiles, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
         }
+    }
+
+    // A hot upgrade hands this process the old one's sockets and players
+    const char *chan = getenv(UPGRADE_ENV);
+    if (chan != NULL) {
+        upgrade_receive(atoi(chan));
+        unsetenv(UPGRADE_ENV);
+    }
 
-             p = next;
+    for (int i = 0; i < nshards; i++) {
+        shards[i].id = i;
+        atomic_init(&shards[i].inbox, NULL);
+        if ((shards[i].evfd = eventfd(0, EFD_NONBLOCK)) == -1) {
+            perror("eventfd");
+            exit(1);
         }
+    }
+    pthread_barrier_init(&upgrade_barrier, NULL, nshards);
+    signal(SIGUSR2, upgrade_signal);
 
-        // Matchmaking loop: find opponents for clients who are not in a game
-        for (struct client *p = head->next; p != NULL; p = p->next) {
-            if (!p->in_game && p->name_set) {
-                opponent = match_opponent(head, p);
-                if (opponent) {
-                    printf("%s and %s have been matched for a battle.\n", p->name, opponent->name);
-                }
-            }
+    // Shard 0 runs on the main thread
+    for (int i = 1; i < nshards; i++) {
+        if (pthread_create(&shards[i].thread, NULL, run_shard, &shards[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
         }
     }
+    run_shard(&shards[0]);
 
     return 0;
 }
 
-int handleclient(struct client *p, struct client *top) {
-   char buf[100], feedback[700], opponent_feedback[700] = "";
-   char broadcast_msg[512];
-   int len = read(p->fd, buf, sizeof(buf) - 1);
-
-    if (len > 0) {
-        // Remove newline character if present at the end of the input buffer
-        //if (buf[len - 1] == '\n') {
-            //buf[len - 1] = '\0';
-            //len--;
-            //if (len > 0 && buf[len - 1] == '\r') {
-                // Also remove carriage return character if present (for CR+LF endings)
-                //buf[len - 1] = '\0';
-            //}
-        //}
-
-        buf[len] = '\0';
+/* The event loop of one shard. Each shard listens on its own
+ * SO_REUSEPORT socket, so the kernel spreads new connections across
+ * shards, and a client stays on the shard that accepted it unless it is
+ * handed off for matchmaking.
+ */
+static void *run_shard(void *arg) {
+    struct client *head = malloc(sizeof(struct client));  // Allocate memory for the dummy head node
+    if (head == NULL) {
+        perror("malloc");
+        exit(1);
+    }
 
-    if (!p->name_set) {
-        char *newline = strchr(buf, '\n');
-        if (newline) {
-            *newline = '\0';  // Terminate at the newline character
-            size_t name_length = newline - buf; // Calculate the length of the input before the newline
-            if (name_length > sizeof(p->name) - 1 - strlen(p->name)) {
-                name_length = sizeof(p->name) - 1 - strlen(p->name); // Limit to available space
-            }
-            strncat(p->name, buf, name_length);
-            p->name_set = 1;
-
-            snprintf(feedback, sizeof(feedback), "\nWelcome, %s! Awaiting opponent...\r\n", p->name);
-            send(p->fd, feedback, strlen(feedback), 0);
-
-            snprintf(broadcast_msg, sizeof(broadcast_msg), "\n*****%s joins the Arena******\r\n", p->name);
-            broadcast(top, broadcast_msg, strlen(broadcast_msg), p->fd);
-
-         printf("Adding client %s\n", p->name);
-        }else {
-            size_t space_left = sizeof(p->name) - strlen(p->name) - 1;
-            if (space_left > 0) {
-                strncat(p->name, buf, space_left);
-            }
-        // No return here to allow further processing
-    }
-}
-
-        if (!p->speaking) {
-            p->speaking = 0;
-            memset(p->speak_buffer, 0, sizeof(p->speak_buffer));
-        }
-
-        if (!p->in_game || !p->is_turn) {
-            if (p->in_game && !p->is_turn){
-                if (buf[0] == 'm'){
-                   if (p->mute_toggle == 0){
-                    p->mute_toggle = 1;
-                    snprintf(feedback, sizeof(feedback), "\nChat is now muted.\n\nWaiting for %s to strike...\n",
-                    p->opponent->name);
-                    send(p->fd, feedback, strlen(feedback), 0);
-
-                   }else{
-                    p->mute_toggle = 0;
-                    snprintf(feedback, sizeof(feedback), "\nChat is now unmuted.\n\nWaiting for %s to strike...\n",
-                    p->opponent->name);
-                    send(p->fd, feedback, strlen(feedback), 0);
-                   }
-
-            }}
-
-            return 0;
-        }
-        if (p->in_game && p->is_turn && p->name_set){
-            if (p->power_moves > 0){
-                if (p->speaking) {
-                    size_t buffer_length = strlen(p->speak_buffer);
-                    size_t max_append = sizeof(p->speak_buffer) - buffer_length - 1; // -1 for null terminator
-
-                    char *newline = strchr(buf, '\n');
-                    if (newline) {
-                        // If newline is found, copy only up to the newline
-                        size_t copy_length = newline - buf;
-                        if (copy_length > max_append) {
-                            copy_length = max_append;
-                        }
-                        strncat(p->speak_buffer, buf, copy_length);
-                        p->speak_buffer[buffer_length + copy_length] = '\0'; // Ensure null-termination
-                        p->speaking = 0;
-                        snprintf(feedback, sizeof(feedback),
-                         "\nYou speak: %s\n\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\n\nIt's your turn:\n(a)ttack\n(p)owermove\n(s)peak something\n(m)ute chat\n",
-                         p->speak_buffer, p->hitpoints,p->power_moves, p->opponent->name, p->opponent->hitpoints);
-                         if (p->opponent->power_moves > 0){
-                            snprintf(opponent_feedback, sizeof(opponent_feedback),
-                             "\n\n%s takes a break to tell you:\n%s\n\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\nWaiting for %s to strike...\n",
-                            p->name, p->speak_buffer, p->opponent->hitpoints, p->opponent->power_moves, p->name, p->hitpoints, p->name);
-                         }else if (p->opponent->power_moves == 0){
-                            snprintf(opponent_feedback, sizeof(opponent_feedback),
-                             "\n\n%s takes a break to tell you:\n%s\n\nYour hitpoints: %d\n\n%s's hitpoints: %d\nWaiting for %s to strike...\n",
-                            p->name, p->speak_buffer, p->opponent->hitpoints, p->name, p->hitpoints, p->name);
-                         }
-                        
-                        memset(p->speak_buffer, 0, sizeof(p->speak_buffer)); // Clear buffer
-                    } else {
-                    // Add character to buffer
-                        if (max_append > 0) {
-                            size_t chunk_length = (size_t)len < max_append ? (size_t)len : max_append;
-                            strncat(p->speak_buffer, buf, chunk_length);
-                            p->speak_buffer[buffer_length + chunk_length] = '\0'; // Ensure null-termination
-                }
-                        return 0;
-                     }
-                }else if (buf[0] == 'm'){
-                   if (p->mute_toggle == 0){
-                    p->mute_toggle = 1;
-                    snprintf(feedback, sizeof(feedback),
-                     "\nChat is now muted.\n\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\n\nIt's your turn:\n(a)ttack\n(p)owermove\n(s)peak something\n(m)ute chat\n",
-                     p->hitpoints, p->power_moves, p->opponent->name, p->opponent->hitpoints);
-
-                   }else{
-                    p->mute_toggle = 0;
-                    snprintf(feedback, sizeof(feedback),
-                     "\nChat is now unmuted.\n\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\n\nIt's your turn:\n(a)ttack\n(p)owermove\n(s)peak something\n(m)ute chat\n",
-                     p->hitpoints, p->power_moves, p->opponent->name, p->opponent->hitpoints);
-                   }
-                }else if (buf[0] == 'a') {
-                    p->opponent->hitpoints = p->opponent->hitpoints > 5 ? p->opponent->hitpoints - 5 : 0;
-                    sprintf(feedback,
-                     "\nYou hit %s for 5 damage!\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\nWaiting for %s to strike...\n",
-                    p->opponent->name, p->hitpoints, p->power_moves, p->opponent->name, p->opponent->hitpoints, p->opponent->name);
-                    if (p->opponent->power_moves > 0){
-                        sprintf(opponent_feedback,
-                         "\n%s hits you for 5 damage!\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\n\nIt's your turn:\n(a)ttack\n(p)owermove\n(s)peak something\n(m)ute chat\n",
-                        p->name, p->opponent->hitpoints, p->opponent->power_moves, p->name, p->hitpoints);
-                    }else if(p->opponent->power_moves == 0){
-                        sprintf(opponent_feedback,
-                         "\n%s hits you for 5 damage!\nYour hitpoints: %d\n\n%s's hitpoints: %d\n\nIt's your turn:\n(a)ttack\n(s)peak something\n(m)ute chat\n",
-                        p->name, p->opponent->hitpoints, p->name, p->hitpoints);
-                    }
-                    p->is_turn = 0;
-                    p->opponent->is_turn = 1;
-                    p->speak_count = 0;
-                } else if (buf[0] == 'p') {
-                    int hit = rand() % 100 < 40;
-                    int damage = hit ? 15 : 0;
-                    p->opponent->hitpoints = p->opponent->hitpoints > damage ? p->opponent->hitpoints - damage : 0;
-                    p->power_moves--;
-                    if (hit){
-                        sprintf(feedback,
-                        "\nYou hit %s for 15 damage!\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\nWaiting for %s to strike...\n",
-                     p->opponent->name,  p->hitpoints, p->power_moves, p->opponent->name, p->opponent->hitpoints, p->opponent->name);
-                        if (p->opponent->power_moves > 0){
-                            sprintf(opponent_feedback,
-                             "\n%s powermoves you for 15 damage!\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\n\nIt's your turn:\n(a)ttack\n(p)owermove\n(s)peak something\n(m)ute chat\n",
-                         p->name, p->opponent->hitpoints, p->opponent->power_moves, p->name, p->hitpoints);
-                        }else if (p->opponent->power_moves == 0){
-                            sprintf(opponent_feedback,
-                             "\n%s powermoves you for 15 damage!\nYour hitpoints: %d\n\n%s's hitpoints: %d\n\nIt's your turn:\n(a)ttack\n(s)peak something\n(m)ute chat\n",
-                         p->name, p->opponent->hitpoints, p->name, p->hitpoints);
-                        }
-                    }else if (!hit){
-                        sprintf(feedback,
-                         "\nYou missed!\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\nWaiting for %s to strike...\n",
-                        p->hitpoints, p->power_moves, p->opponent->name, p->opponent->hitpoints, p->opponent->name);
-                         if (p->opponent->power_moves > 0){
-                            sprintf(opponent_feedback,
-                             "\n%s's powermove missed!\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\n\nIt's your turn:\n(a)ttack\n(p)owermove\n(s)peak something\n(m)ute chat\n",
-                         p->name, p->opponent->hitpoints, p->opponent->power_moves, p->name, p->hitpoints);
-                        }else if (p->opponent->power_moves == 0){
-                            sprintf(opponent_feedback,
-                             "\n%s's powermove missed!\nYour hitpoints: %d\n\n%s's hitpoints: %d\n\nIt's your turn:\n(a)ttack\n(s)peak something\n(m)ute chat\n",
-                         p->name, p->opponent->hitpoints, p->name, p->hitpoints);
-                        }
-                    }
-                    p->is_turn = 0;
-                    p->opponent->is_turn = 1;
-                    p->speak_count = 0;
-                
-                }else if (buf[0] == 's' && !p->speaking){
-                    // Enter speaking mode
-                    if (p->opponent->mute_toggle == 1){
-                        snprintf(feedback, sizeof(feedback),
-                         "\nYou cannot speak with %s, their mute toggle is on.\n\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints:%d\n\nIt's your turn:\n(a)ttack\n(p)owermove\n(s)peak something\n(m)ute chat\n",
-                        p->opponent->name, p->hitpoints, p->power_moves, p->opponent->name, p->opponent->hitpoints);
-                    }else if (p->speak_count == 3){
-                       snprintf(feedback, sizeof(feedback),
-                        "\nYou have spoken enough! It is time to attack.\n\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints:%d\n\nIt's your turn:\n(a)ttack\n(p)owermove\n(m)ute chat\n",
-                        p->hitpoints, p->power_moves, p->opponent->name, p->opponent->hitpoints);
-                        p->speak_count++;
-                    }else if (p->speak_count == 4){
-                        return 0;
-                }else{
-                    p->speaking = 1;
-                    p->speak_count++;
-                    snprintf(feedback, sizeof(feedback), "\nSpeak: ");
-                }
-                }else{
-                    return 0;
-                }
-           }else if (p->power_moves == 0){
-                if (p->speaking) {
-                    // In speaking mode, collect characters into buffer
-                    size_t buffer_length = strlen(p->speak_buffer);
-                    size_t max_append = sizeof(p->speak_buffer) - buffer_length - 1; // -1 for null terminator
-
-                    char *newline = strchr(buf, '\n');
-                    if (newline) {
-                        // If newline is found, copy only up to the newline
-                        size_t copy_length = newline - buf;
-                        if (copy_length > max_append) {
-                            copy_length = max_append;
-                        }
-                        strncat(p->speak_buffer, buf, copy_length);
-                        p->speak_buffer[buffer_length + copy_length] = '\0'; // Ensure null-termination
-                        p->speaking = 0;
-                        snprintf(feedback, sizeof(feedback),
-                         "You speak: %s\nYour hitpoints: %d\n\n%s's hitpoints: %d\n\nIt's your turn:\n(a)ttack\n(s)peak something\n(m)ute chat\n",
-                         p->speak_buffer, p->hitpoints, p->opponent->name,  p->opponent->hitpoints);
-                        if (p->opponent->power_moves > 0){
-                            snprintf(opponent_feedback, sizeof(opponent_feedback),
-                             "\n\n%s takes a break to tell you:\n%s\n\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\nWaiting for %s to strike...\n",
-                            p->name, p->speak_buffer,p->opponent->hitpoints, p->opponent->power_moves, p->name, p->hitpoints, p->name);
-                        }else if (p->opponent->power_moves == 0){
-                            snprintf(opponent_feedback, sizeof(opponent_feedback),
-                             "\n\n%s takes a break to tell you:\n%s\n\nYour hitpoints: %d\n\n%s's hitpoints: %d\nWaiting for %s to strike...\n",
-                            p->name, p->speak_buffer,p->opponent->hitpoints, p->name, p->hitpoints, p->name);
-                        }
-                        memset(p->speak_buffer, 0, sizeof(p->speak_buffer)); // Clear buffer
-                    } else {
-                    // Add character to buffer
-                        if (max_append > 0) {
-                            size_t chunk_length = (size_t)len < max_append ? (size_t)len : max_append;
-                            strncat(p->speak_buffer, buf, chunk_length);
-                            p->speak_buffer[buffer_length + chunk_length] = '\0'; // Ensure null-termination
-                        }
-                         return 0; // Return early to keep collecting characters
-                     }
-                }else if (buf[0] == 'm'){
-                   if (p->mute_toggle == 0){
-                    p->mute_toggle = 1;
-                    snprintf(feedback, sizeof(feedback),
-                     "\nChat is now muted.\n\nYour hitpoints: %d\n\n%s's hitpoints: %d\n\nIt's your turn:\n(a)ttack\n(s)peak something\n(m)ute chat\n",
-                     p->hitpoints, p->opponent->name, p->opponent->hitpoints);
-                   }else{
-                    p->mute_toggle = 0;
-                    snprintf(feedback, sizeof(feedback),
-                     "\nChat is now unmuted.\n\nYour hitpoints: %d\n\n%s's hitpoints: %d\n\nIt's your turn:\n(a)ttack\n(s)peak something\n(m)ute chat\n",
-                     p->hitpoints, p->opponent->name, p->opponent->hitpoints);
-                   }
-                }else if (buf[0] == 'a') {
-                    p->opponent->hitpoints = p->opponent->hitpoints > 5 ? p->opponent->hitpoints - 5 : 0;
-                     sprintf(feedback,
-                      "\nYou hit %s for 5 damage!\nYour hitpoints: %d\n\n%s's hitpoints: %d\nWaiting for %s to strike...\n",
-                        p->opponent->name, p->hitpoints, p->opponent->name, p->opponent->hitpoints, p->opponent->name);
-                    if (p->opponent->power_moves > 0){
-                        sprintf(opponent_feedback,
-                         "\n%s hits you for 5 damage!\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\n\nIt's your turn:\n(a)ttack\n(p)owermove\n(s)peak something\n(m)ute chat\n",
-                        p->name, p->opponent->hitpoints, p->opponent->power_moves, p->name, p->hitpoints);
-                    }else if (p->opponent->power_moves == 0){
-                        sprintf(opponent_feedback,
-                         "\n%s hits you for 5 damage!\nYour hitpoints: %d\n\n%s's hitpoints: %d\n\nIt's your turn:\n(a)ttack\n(s)peak something\n(m)ute chat\n",
-                        p->name, p->opponent->hitpoints, p->name, p->hitpoints);
-                    }
-                    p->is_turn = 0;
-                    p->opponent->is_turn = 1;
-                    p->speak_count = 0;
-            }else if (buf[0] == 's' && !p->speaking){
-                if (p->opponent->mute_toggle == 1){
-                        snprintf(feedback, sizeof(feedback),
-                         "\nYou cannot speak with %s, their mute toggle is on.\n\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints:%d\n\nIt's your turn:\n(a)ttack\n(p)owermove\n(s)peak something\n(m)ute chat\n",
-                        p->opponent->name, p->hitpoints, p->power_moves, p->opponent->name, p->opponent->hitpoints);
-                }else if (p->speak_count == 3){
-                        snprintf(feedback, sizeof(feedback),
-                         "\nYou have spoken enough! It is time to attack.\n\nYour hitpoints: %d\n\n%s's hitpoints: %d\n\nIt's your turn:\n(a)ttack\n(m)ute chat\n",
-                         p->hitpoints, p->opponent->name, p->opponent->hitpoints);
-                         p->speak_count++;
-                    }else if (p->speak_count == 4){
-                        return 0;
-                    }else{
-                        p->speaking = 1;
-                        p->speak_count++;
-                        snprintf(feedback, sizeof(feedback), "\nSpeak: ");
-                }}else{
-                    return 0;
-                }
-                }else{
-                    return 0;
-                }
-        send(p->fd, feedback, strlen(feedback), 0);
-        if (opponent_feedback[0] != '\0') {
-            send(p->opponent->fd, opponent_feedback, strlen(opponent_feedback), 0);
+    self = arg;
+    rng_seed(&rng, now_ns() ^ (uint64_t)self->id << 56);
+
+    // Initialize the dummy head node
+    head->name[0] = 'S';  
+    head->name[1] = '\0';
+    head->in_game = 1;
+    head->name_set = 1;
+    head->next = NULL;  
+    head->prev = head;
+
+    // After a hot upgrade the sockets come from the old process
+    int listenfd, statsfd = -1;
+    if (self->up.data != NULL) {
+        struct upgrade_shard us;
+        memcpy(&us, self->up.data, sizeof(us));
+        listenfd = self->up.fds[0];
+        if (us.has_stats) {
+            statsfd = self->up.fds[1];
         }
+    } else {
+        listenfd = bindandlisten();
 
-        if (p->opponent->hitpoints <= 0) {
-        sprintf(feedback, "Victory! %s's hitpoints are now 0. You win!\nAwaiting next opponent...\r\n", p->opponent->name);
-        sprintf(opponent_feedback, "Defeat! Your hitpoints are now 0. %s wins!\nAwaiting next opponent...\r\n", p->name);
-        send(p->fd, feedback, strlen(feedback), 0);
-        send(p->opponent->fd, opponent_feedback, strlen(opponent_feedback), 0);
-        end_match(&top, p, p->opponent);  
+        // The first shard also answers the local stats endpoint
+        if (self->id == 0 && stats_port > 0) {
+            statsfd = bindstats(stats_port);
+        }
     }
 
-        return 0;
-        }
-    }else if (len == 0) {
-    // Client disconnection
-   if (p->in_game && p->opponent != NULL) {
-        // Client was in a game, declare opponent as winner
-        struct client *opponent = p->opponent;
-        char win_msg[256];
-        snprintf(win_msg, sizeof(win_msg), "Opponent %s disconnected. You win!\nAwaiting next opponent...\r\n", p->name);
-        send(opponent->fd, win_msg, strlen(win_msg), 0);
+    wheel_now = now_ns() / 1000000 / TICK_MS;
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
-        opponent->in_game = 0;
-        opponent->opponent = NULL;
-        opponent->hitpoints = 30;
-        opponent->last_opponent = NULL;
-        opponent->power_moves = rand() % 3 + 1;    
-        opponent->is_turn = 0;                       // Clear the opponent since the match is over
-        move_client_end(&top, opponent);
-        snprintf(broadcast_msg, sizeof(broadcast_msg), "\n*****%s left the Arena******\r\n", p->name);
-        broadcast(top, broadcast_msg, strlen(broadcast_msg), p->fd);
-         // Move the winning client to the end of the list
-    }else{
-        snprintf(broadcast_msg, sizeof(broadcast_msg), "\n*****%s left the Arena******\r\n", p->name);
-        broadcast(top, broadcast_msg, strlen(broadcast_msg), p->fd);
-    }
-    return -1; 
-}else{
-    if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            
-            return -1;
+    if (want_uring) {
+#ifdef HAVE_URING
+        if (uring_setup() == 0) {
+            use_uring = 1;
+            uring_loop(head, listenfd, statsfd);
+            return NULL;
         }
-}
-    return 0;
+        logmsg(LOG_WARN, EV_SERVER, "io_uring unavailable (%m), using epoll");
+#else
+        logmsg(LOG_WARN, EV_SERVER, "Built without io_uring, using epoll");
+#endif
+    }
+    epoll_loop(head, listenfd, statsfd);
+    return NULL;
 }
 
- /* bind and listen, abort on error
-  * returns FD of listening socket
-  */
-int bindandlisten(void) {
-    struct sockaddr_in r;
-    int listenfd;
+static void epoll_loop(struct client *head, int listenfd, int statsfd) {
+    int nready;
+    struct epoll_event ev, events[MAXEVENTS];
 
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket");
+    if ((epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
         exit(1);
     }
-    int yes = 1;
-    if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) == -1) {
-        perror("setsockopt");
-    }
-    memset(&r, '\0', sizeof(r));
-    r.sin_family = AF_INET;
-    r.sin_addr.s_addr = INADDR_ANY;
-    r.sin_port = htons(PORT);
 
-    if (bind(listenfd, (struct sockaddr *)&r, sizeof r)) {
-        perror("bind");
+    // The listening socket is registered with a NULL pointer so it can be
+    // told apart from client sockets, which carry their struct client.
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) == -1) {
+        perror("epoll_ctl");
         exit(1);
     }
 
-    if (listen(listenfd, 10)) {
-        perror("listen");
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = (void *)&inbox_tag;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, self->evfd, &ev) == -1) {
+        perror("epoll_ctl");
         exit(1);
     }
-    return listenfd;
-}
 
-static struct client *addclient(struct client *top, int fd, struct in_addr addr) {
-    struct client *p = malloc(sizeof(struct client));
-    if (!p) {
-        perror("malloc");
-        exit(1);
+    if (statsfd != -1) {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = (void *)&stats_tag;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, statsfd, &ev) == -1) {
+            perror("epoll_ctl");
+            exit(1);
+        }
     }
 
-    // Initialize the new client's attributes
-    p->fd = fd;
-    p->ipaddr = addr;
-    p->next = NULL;
-    p->in_game = 0; // Initially not in a game
-    p->hitpoints = 30; 
-    p->power_moves = rand() % 3 + 1; 
-    p->is_turn = 0; // It's not their turn yet
-    p->name[0] = '\0'; // Set the name to an empty string
-    p->opponent = NULL; // No opponent yet
-    p->last_opponent = NULL; // No last opponent yet
-    p->name_set = 0;
-    p->speaking = 0;
-    p->speak_buffer[0] = '\0';
-    p->speak_count = 0;
-    p->mute_toggle = 0;
-    // Send a welcome message to the client asking for their name
-    char *welcome_msg = "Welcome! Please enter your name:";
-    if (send(fd, welcome_msg, strlen(welcome_msg), 0) == -1) {
-        perror("send");
-        free(p); // Cleanup allocation since send failed
-        return top;
+    if (self->up.data != NULL) {
+        upgrade_restore(head);
     }
 
-
-    if (top == NULL){
-        return p;
-    }else{
-        //Traversing list until the end
-        struct client *current = top;
-        while(current->next != NULL){
-            current = current->next;
+    while (1) {
+        int timeout = tick_wait();
+        nready = epoll_wait(epfd, events, MAXEVENTS, timeout);
+        STAT(syscalls, 1);
+        uint64_t loop_start = now_ns();
+        tick_start(loop_start, nready > 0);
+        if (nready == 0 && timeout == SECONDS * 1000) {
+            logmsg(LOG_INFO, EV_SERVER, "No response from clients in %d seconds", SECONDS);
+            continue;
         }
-        //Append new client
-        current->next = p;
-    }
 
+        if (nready == -1) {
+            if (errno != EINTR) {
+                logmsg(LOG_ERROR, EV_ERROR, "epoll_wait: %m");
+            }
+            continue;
+        }
 
-    return p; 
-}
-
-static struct client *removeclient(struct client *top, int fd) {
-    struct client *prev = NULL;
-    struct client *cur = top;
+        // Timers run first so anything armed below counts from now
+        run_timers(head);
+        if (accept_retry != 0 && loop_start >= accept_retry) {
+            accept_retry = 0;
+            accept_pending(head, listenfd);
+        }
 
-    while (cur != NULL && cur->fd != fd) {
-        prev = cur;
-        cur = cur->next;
-    }
+        epoll_events(head, events, nready, listenfd, statsfd);
 
-    if (cur == NULL) {
-        // Client not found
-        return top;
-    }
+        // A tick takes in everything that is ready, however much
+        while (tick_ms > 0 && nready == MAXEVENTS) {
+            nready = epoll_wait(epfd, events, MAXEVENTS, 0);
+            STAT(syscalls, 1);
+            if (nready <= 0) {
+                break;
+            }
+            epoll_events(head, events, nready, listenfd, statsfd);
+        }
 
-    if (prev == NULL) {
-        // Removing the first client in the list
-        top = cur->next;
-    } else {
-        // Removing a client that is not the first
-        prev->next = cur->next;
+        finish_pass(head);
+        hist_add(&self->stats.loop_ns, now_ns() - loop_start);
+        if (atomic_load(&upgrade_pending)) {
+            upgrade_shard(head, listenfd, statsfd);
+        }
     }
-    printf("Removing client %s\n", cur->name);
-    free(cur);
-    return top;
 }
 
+/* Accept until the backlog is drained. The listener is edge-triggered,
+ * so stopping early for any other reason leaves accept_retry set and
+ * the loop comes back to it.
+ */
+static void accept_pending(struct client *head, int listenfd) {
+    struct sockaddr_in q;
+    socklen_t len;
+    int clientfd;
 
-static void broadcast(struct client *top, char *s, int size, int exclude_fd) {
-    struct client *p;
-    // Skip the dummy head node by starting with top->next
-    for (p = top->next; p; p = p->next) {
-        if (p->fd != exclude_fd) {
-            // Send the message to this client
-            if (send(p->fd, s, size, 0) < 0) {
-                perror("broadcast write");
-                // Handle error, e.g., remove the client
+    while (1) {
+        len = sizeof(q);
+        clientfd = accept4(listenfd, (struct sockaddr *)&q, &len, SOCK_NONBLOCK);
+        STAT(syscalls, 1);
+        if (clientfd < 0) {
+            if (accept_failed(listenfd, errno)) {
+                continue;
             }
+            break;
         }
+        accept_client(head, clientfd, q.sin_addr);
     }
 }
-static struct client *match_opponent(struct client *top, struct client *current) {
-    struct client *p, *matched = NULL;
 
-    for (p = top; p != NULL; p = p->next) {
-        if (p != current && !p->in_game && p->last_opponent != current && p->name_set) {
-            matched = p;
-            break;
+/* Act on one epoll_wait()'s worth of events. */
+static void epoll_events(struct client *head, struct epoll_event *events, int nready, int listenfd, int statsfd) {
+    for (int i = 0; i < nready; i++) {
+        struct client *p = events[i].data.ptr;
+
+        if (p == (void *)&inbox_tag) {
+            adopt_clients(head);
+            continue;
         }
-    }
 
-    if (matched) {
-        start_battle(current, matched);
-    }
+        if (p == (void *)&stats_tag) {
+            serve_stats(statsfd);
+            continue;
+        }
 
-    return matched;
+        if (p == NULL) {
+            accept_pending(head, listenfd);
+            continue;
+        }
+
+        if (p->dead) {
+            continue;
+        }
+        if (events[i].events & EPOLLOUT) {
+            flush_client(p);
+        }
+        if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !p->dead) {
+            uint64_t t = now_ns();
+            if (handleclient(p, head) == -1) {
+                kill_client(p);
+            }
+            hist_add(&self->stats.handle_ns, now_ns() - t);
+        }
+    }
+}
+
+/* Tick mode (-T): after a pass that had work, the next one is held
+ * back until a tick has gone by since it started. Whatever arrives
+ * meanwhile is then read and applied in one pass, and each client's
+ * output from all of it leaves in one writev() at the end of the pass.
+ * An idle shard still blocks, so the first input after a quiet spell
+ * is handled at once. Players wait at most a tick longer for a reply.
+ * returns the timeout for the wait that starts the next pass
+ */
+static int tick_wait(void) {
+    if (tick_ms <= 0 || !tick_busy) {
+        return loop_timeout();
+    }
+    uint64_t now = now_ns();
+    if (now < tick_next) {
+        uint64_t ns = tick_next - now;
+        struct timespec nap = { ns / 1000000000, ns % 1000000000 };
+        nanosleep(&nap, NULL);
+    }
+    return 0;
+}
+
+/* Note when a pass started, and whether it had anything to do. */
+static void tick_start(uint64_t start, int busy) {
+    tick_busy = busy;
+    tick_next = start + (uint64_t)tick_ms * 1000000;
+}
+
+/* Set up a freshly accepted connection and start watching it. A
+ * connection over its address's cap is closed before anything is
+ * allocated or sent for it.
+ */
+static void accept_client(struct client *head, int clientfd, struct in_addr addr) {
+    struct ipentry *ip;
+
+    shedding = 0;
+    if (ip_admit(addr, 0, &ip) == -1) {
+        close(clientfd);
+        STAT(syscalls, 1);
+        STAT(refused_ip, 1);
+        logmsg(LOG_DEBUG, EV_JOIN, "Refusing %s: too many connections", inet_ntoa(addr));
+        return;
+    }
+
+    // Output is already coalesced per loop pass; Nagle would
+    // only hold the second of two replies back for an ACK
+    int one = 1;
+    setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    STAT(syscalls, 1);
+
+    struct client *p = addclient(head, clientfd, addr);
+    p->ip = ip;
+    STAT(accepted, 1);
+
+    if (watch_client(p) == -1) {
+        logmsg(LOG_ERROR, EV_ERROR, "epoll_ctl: %m");
+        close(clientfd);
+        removeclient(head, clientfd);
+        ip_release(ip);
+    }
+}
+
+/* Deal with an accept() that failed with err. A connection that was
+ * reset while it sat in the backlog is skipped. Running out of
+ * descriptors would leave the listener readable and every client
+ * waiting in the backlog, so the spare descriptor is given up to
+ * accept and hang up on each pending connection in turn. Whenever the
+ * backlog may not be empty yet, such as when there was no spare to
+ * give up or memory ran short, accept_retry is set so the shard tries
+ * again ACCEPT_RETRY_MS later instead of waiting for a new connection.
+ * returns 1 if accepting should go on, 0 to stop for now
+ */
+static int accept_failed(int listenfd, int err) {
+    int fd;
+
+    switch (err) {
+    case EAGAIN:
+        return 0;
+    case EINTR:
+    case ECONNABORTED:
+    case EPROTO:
+    case EPERM:
+        return 1;
+    case EMFILE:
+    case ENFILE:
+        if (!shedding) {
+            logmsg(LOG_WARN, EV_ERROR, "accept: %s, refusing new connections", strerror(err));
+            shedding = 1;
+        }
+        while (1) {
+            if (spare_fd != -1) {
+                close(spare_fd);
+            }
+            fd = accept(listenfd, NULL, NULL);
+            err = errno;
+            if (fd != -1) {
+                close(fd);
+                STAT(shed, 1);
+            }
+            spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            STAT(syscalls, 3);
+            if (fd == -1 && err == EAGAIN) {
+                return 0;
+            }
+            if (fd == -1 && err != EINTR && err != ECONNABORTED && err != EPROTO && err != EPERM) {
+                break;
+            }
+        }
+        accept_retry = now_ns() + (uint64_t)ACCEPT_RETRY_MS * 1000000;
+        return 0;
+    default:
+        errno = err;
+        logmsg(LOG_ERROR, EV_ERROR, "accept: %m");
+        accept_retry = now_ns() + (uint64_t)ACCEPT_RETRY_MS * 1000000;
+        return 0;
+    }
+}
+
+/* Per-address limits. Each address with connections open has an
+ * ipentry in ip_table, found by hashing the address and guarded by one
+ * of IP_LOCKS stripe locks, so shards rarely contend. The entry counts
+ * the address's connections against -c and holds two token buckets,
+ * for input lines (-r a second) and for chat (CHAT_RATE a minute),
+ * shared by all of them. It goes when the last connection closes.
+ * Loopback addresses are never limited, so local load tests are not.
+ */
+static uint32_t ip_bucket(uint32_t addr) {
+    return (addr * 2654435761u) >> (32 - IP_BITS);
+}
+
+/* Count a new connection from addr, unless the address is at its cap
+ * and force is not set. *out gets the address's entry, or NULL when
+ * it is not limited.
+ * returns 0 if the connection may stay, -1 if it must be refused
+ */
+static int ip_admit(struct in_addr addr, int force, struct ipentry **out) {
+    *out = NULL;
+    if ((ntohl(addr.s_addr) >> 24) == 127 || (ip_conns <= 0 && line_rate <= 0 && CHAT_RATE <= 0)) {
+        return 0;
+    }
+
+    uint32_t b = ip_bucket(addr.s_addr);
+    pthread_mutex_t *lock = &ip_locks[b & (IP_LOCKS - 1)];
+    struct ipentry *e;
+
+    pthread_mutex_lock(lock);
+    for (e = ip_table[b]; e != NULL; e = e->next) {
+        if (e->addr == addr.s_addr) {
+            break;
+        }
+    }
+    if (e == NULL) {
+        if ((e = malloc(sizeof(*e))) == NULL) {
+            pthread_mutex_unlock(lock);
+            return force ? 0 : -1;
+        }
+        e->addr = addr.s_addr;
+        e->conns = 0;
+        e->line_tokens = (double)line_rate * LINE_BURST_SECS;
+        e->chat_tokens = CHAT_BURST;
+        e->refill = now_ns();
+        e->next = ip_table[b];
+        ip_table[b] = e;
+    } else if (!force && ip_conns > 0 && e->conns >= ip_conns) {
+        pthread_mutex_unlock(lock);
+        return -1;
+    }
+    e->conns++;
+    pthread_mutex_unlock(lock);
+    *out = e;
+    return 0;
+}
+
+/* A connection counted by ip_admit() has closed. */
+static void ip_release(struct ipentry *e) {
+    if (e == NULL) {
+        return;
+    }
+
+    uint32_t b = ip_bucket(e->addr);
+    pthread_mutex_t *lock = &ip_locks[b & (IP_LOCKS - 1)];
+
+    pthread_mutex_lock(lock);
+    if (--e->conns == 0) {
+        struct ipentry **pp = &ip_table[b];
+        while (*pp != e) {
+            pp = &(*pp)->next;
+        }
+        *pp = e->next;
+        free(e);
+    }
+    pthread_mutex_unlock(lock);
+}
+
+/* Spend a token on one input line, or one chat line if chat is set.
+ * returns 1 if the line may be handled, 0 if it is over the limit
+ */
+static int ip_take(struct ipentry *e, int chat) {
+    if (e == NULL) {
+        return 1;
+    }
+
+    uint32_t b = ip_bucket(e->addr);
+    pthread_mutex_t *lock = &ip_locks[b & (IP_LOCKS - 1)];
+    uint64_t now = now_ns();
+    int ok;
+
+    pthread_mutex_lock(lock);
+    double secs = (now - e->refill) / 1e9;
+    e->refill = now;
+    e->line_tokens += secs * line_rate;
+    if (e->line_tokens > (double)line_rate * LINE_BURST_SECS) {
+        e->line_tokens = (double)line_rate * LINE_BURST_SECS;
+    }
+    e->chat_tokens += secs * CHAT_RATE / 60;
+    if (e->chat_tokens > CHAT_BURST) {
+        e->chat_tokens = CHAT_BURST;
+    }
+    if (chat) {
+        ok = CHAT_RATE <= 0 || e->chat_tokens >= 1;
+        if (ok && CHAT_RATE > 0) {
+            e->chat_tokens--;
+        }
+    } else {
+        ok = line_rate <= 0 || e->line_tokens >= 1;
+        if (ok && line_rate > 0) {
+            e->line_tokens--;
+        }
+    }
+    pthread_mutex_unlock(lock);
+    return ok;
+}
+
+/* Whether p may send another line right now; the line is dropped
+ * unread if not.
+ */
+static int line_allowed(struct client *p) {
+    if (ip_take(p->ip, 0)) {
+        return 1;
+    }
+    STAT(lines_limited, 1);
+    return 0;
+}
+
+/* Start delivering p's input and output events to this shard. */
+static int watch_client(struct client *p) {
+    struct epoll_event ev;
+
+#ifdef HAVE_URING
+    if (use_uring) {
+        uring_recv(p);
+        return 0;
+    }
+#endif
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = p;
+    STAT(syscalls, 1);
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, p->fd, &ev);
+}
+
+/* The second half of every loop pass, whichever backend drives it:
+ * remove dead clients, run matchmaking and hand the output to the
+ * kernel, repeating while that kills anyone, then rebalance shards.
+ */
+static void finish_pass(struct client *head) {
+    struct client *opponent;
+
+    do {
+        reap_clients(head);
+
+        // Matchmaking: pair waiting clients when the queue has changed,
+        // and now and then while unmatched windows keep widening. Each
+        // match_opponent() is bounded by RATING_BUCKETS, but a pass
+        // still tries every waiting client, oldest first, so it costs
+        // O(waiting): on every pass that follows an arrival, and every
+        // MATCH_RETRY_MS while anyone is left unmatched. Trying only
+        // the arrivals would make a long waiter, whose window is the
+        // widest, wait for the retry before it could take a newcomer.
+        uint64_t t = now_ns();
+        if (queue_dirty || (wait_head != wait_tail && t >= match_retry)) {
+            queue_dirty = 0;
+            struct client *p = wait_head, *next;
+            for (; p != NULL; p = next) {
+                next = p->seat->wait_next;
+                if ((opponent = match_opponent(p, t)) != NULL) {
+                    logmsg(LOG_INFO, EV_MATCH_START, "%s and %s have been matched for a battle.", p->name, opponent->name);
+                    if (opponent == next) {
+                        next = opponent->seat->wait_next;
+                    }
+                }
+            }
+            match_retry = t + (uint64_t)MATCH_RETRY_MS * 1000000;
+            hist_add(&self->stats.match_ns, now_ns() - t);
+        }
+
+        flush_output();
+    } while (dead_list != NULL);
+
+    if (nshards > 1) {
+        balance_shards(head);
+    }
+}
+
+/* Pair waiting players across shards without a lock. A shard left with
+ * a single waiter it cannot match advertises itself in `lonely`; the
+ * next shard to find itself in the same position claims the advert and
+ * hands its waiter over, so the two meet on the advertising shard. A
+ * stale advert only costs one client waiting on another shard, where it
+ * is matched as soon as anyone else turns up.
+ */
+static void balance_shards(struct client *top) {
+    struct shard *other = atomic_load(&lonely);
+    struct client *w = wait_head;
+
+    if (w == NULL || w != wait_tail) {
+        // Nobody waiting, or enough local players to pair; withdraw
+        if (other == self) {
+            atomic_compare_exchange_strong(&lonely, &other, NULL);
+        }
+        return;
+    }
+
+    if (other == NULL) {
+        atomic_compare_exchange_strong(&lonely, &other, self);
+        return;
+    }
+    if (other == self || w->out_head != NULL) {
+        // Output still queued here; try again on a later pass
+        return;
+    }
+    if (!atomic_compare_exchange_strong(&lonely, &other, NULL)) {
+        return;
+    }
+
+#ifdef HAVE_URING
+    if (use_uring) {
+        // The socket can only move once its receive is gone; the final
+        // completion of the cancelled receive finishes the handoff
+        w->migrate_to = other;
+        dequeue_waiting(w);
+        uring_cancel(w);
+        return;
+    }
+#endif
+    handoff_client(top, w, other);
+}
+
+/* Move the waiting client w to the other shard's inbox.
+ * returns 0 once w is gone from this shard, -1 if it stays
+ */
+static int handoff_client(struct client *top, struct client *w, struct shard *other) {
+    struct handoff *h = malloc(sizeof(struct handoff));
+    if (!h) {
+        logmsg(LOG_ERROR, EV_ERROR, "malloc: %m");
+        return -1;
+    }
+    h->fd = w->fd;
+    h->ipaddr = w->ipaddr;
+    h->ip = w->ip;
+    memcpy(h->name, w->name, sizeof(h->name));
+    h->mute_toggle = w->muted;
+    h->binary = w->binary;
+    h->profile = w->profile;
+    h->rating = w->rating;
+    profile_locate(w, NULL);
+    if (w->rlen > 0) {
+        memcpy(h->rbuf, w->rbuf, w->rlen);
+    }
+    h->rlen = w->rlen;
+    h->rskip = w->rskip;
+
+    if (!use_uring) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, NULL);
+        STAT(syscalls, 1);
+    }
+    removeclient(top, w->fd);
+
+    h->next = atomic_load(&other->inbox);
+    while (!atomic_compare_exchange_weak(&other->inbox, &h->next, h))
+        ;
+    STAT(handoffs, 1);
+    uint64_t one = 1;
+    if (write(other->evfd, &one, sizeof(one)) == -1) {
+        logmsg(LOG_ERROR, EV_ERROR, "eventfd write: %m");
+    }
+    return 0;
+}
+
+/* Take in every client other shards have handed to this one and queue
+ * them for matchmaking.
+ */
+static void adopt_clients(struct client *top) {
+    uint64_t count;
+
+    while (read(self->evfd, &count, sizeof(count)) > 0)
+        ;
+
+    struct handoff *h = atomic_exchange(&self->inbox, NULL);
+    while (h != NULL) {
+        struct handoff *next = h->next;
+        struct client *p = newclient(top, h->fd, h->ipaddr);
+
+        p->ip = h->ip;
+        memcpy(p->name, h->name, sizeof(p->name));
+        p->name_set = 1;
+        p->muted = h->mute_toggle;
+        p->binary = h->binary;
+        p->profile = h->profile;
+        p->rating = h->rating;
+        profile_locate(p, p);
+        if (h->rlen > 0) {
+            p->rbuf = rbuf_alloc();
+            memcpy(p->rbuf, h->rbuf, h->rlen);
+        }
+        p->rlen = h->rlen;
+        p->rskip = h->rskip;
+        update_timeout(p);
+
+        if (watch_client(p) == -1) {
+            logmsg(LOG_ERROR, EV_ERROR, "epoll_ctl: %m");
+            kill_client(p);
+        } else {
+            enqueue_waiting(p);
+        }
+        free(h);
+        h = next;
+    }
+}
+
+/* Give p somewhere to receive into: the buffer holding its partial
+ * line if it has one, or else the shard's scratch buffer. Only one
+ * client's input is framed at a time, so they can all share it.
+ */
+static void rbuf_open(struct client *p) {
+    if (p->rbuf == NULL) {
+        p->rbuf = rbuf_scratch;
+    }
+}
+
+/* Done framing p's input: a partial line moves out of the scratch
+ * buffer into one of p's own, and a buffer left empty goes back to the
+ * pool.
+ */
+static void rbuf_close(struct client *p) {
+    if (p->rlen == 0) {
+        if (p->rbuf != rbuf_scratch) {
+            rbuf_free(p->rbuf);
+        }
+        p->rbuf = NULL;
+    } else if (p->rbuf == rbuf_scratch) {
+        p->rbuf = rbuf_alloc();
+        memcpy(p->rbuf, rbuf_scratch, p->rlen);
+    }
+}
+
+/* Read everything the socket has and hand each complete line to
+ * processline(). Bytes after the last newline stay in p->rbuf until the
+ * rest of the line arrives.
+ * returns -1 if the client hung up or errored, 0 otherwise
+ */
+int handleclient(struct client *p, struct client *top) {
+    int len;
+
+    // Edge-triggered epoll only reports new data once, so keep reading
+    // until the socket is drained.
+    rbuf_open(p);
+    while (1) {
+        len = read(p->fd, p->rbuf + p->rlen, RBUF_SIZE - p->rlen);
+        STAT(syscalls, 1);
+        if (len > 0) {
+            p->rlen += len;
+            frame_lines(p, top);
+            if (p->dead) {
+                rbuf_close(p);
+                return 0;
+            }
+            continue;
+        }
+        if (len == -1 && errno == EINTR) {
+            continue;
+        }
+        break;
+    }
+    rbuf_close(p);
+
+    if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    return -1;
+}
+
+/* Pull every complete line out of p->rbuf and run it through the game
+ * logic, then shift any partial line to the front of the buffer. A line
+ * that fills the whole buffer is cut there and the rest of it, up to
+ * the next newline, is thrown away.
+ */
+static void frame_lines(struct client *p, struct client *top) {
+    int start = 0;
+    char *nl;
+
+    // A binary client says so before it gives a name
+    if (!p->name_set && !p->binary && p->rlen > 0 && p->rbuf[0] == PROTO_HELLO[0]) {
+        if (p->rlen < PROTO_HELLO_LEN) {
+            return;
+        }
+        if (!memcmp(p->rbuf, PROTO_HELLO, PROTO_HELLO_LEN)) {
+            p->binary = 1;
+            p->rlen -= PROTO_HELLO_LEN;
+            memmove(p->rbuf, p->rbuf + PROTO_HELLO_LEN, p->rlen);
+            send_screen(p, T_HELLO, 0, 0, NULL);
+        }
+    }
+    if (p->binary) {
+        frame_binary(p, top);
+        return;
+    }
+
+    while (!p->dead && (nl = memchr(p->rbuf + start, '\n', p->rlen - start)) != NULL) {
+        int end = nl - p->rbuf;
+        int skip = p->rskip;
+
+        p->rskip = 0;
+        *nl = '\0';
+        if (end > start && p->rbuf[end - 1] == '\r') {
+            p->rbuf[end - 1] = '\0';
+        }
+        if (!skip && line_allowed(p)) {
+            processline(p, top, p->rbuf + start);
+        }
+        start = end + 1;
+    }
+
+    if (p->dead) {
+        return;
+    }
+
+    if (start == 0 && p->rlen == RBUF_SIZE) {
+        // No newline in a full buffer: treat what we have as the line
+        if (!p->rskip && line_allowed(p)) {
+            char line[RBUF_SIZE + 1];
+            memcpy(line, p->rbuf, p->rlen);
+            line[p->rlen] = '\0';
+            processline(p, top, line);
+        }
+        p->rskip = 1;
+        p->rlen = 0;
+        return;
+    }
+
+    p->rlen -= start;
+    memmove(p->rbuf, p->rbuf + start, p->rlen);
+}
+
+/* Tell everyone that p is leaving; if p was mid-match its opponent wins
+ * and goes back to the waiting queue.
+ */
+static void disconnect_client(struct client *p, struct client *top) {
+    // Client disconnection
+    if (p->in_game && p->seat->opponent != NULL) {
+        // Client was in a game, declare opponent as winner
+        struct client *opponent = p->seat->opponent;
+        send_screen(opponent, T_FORFEIT, 0, 0, NULL);
+        match_over(opponent);
+        profile_record(opponent, p);
+        send_board(opponent);
+
+        opponent->in_game = 0;
+        STAT(matches_ended, 1);
+        opponent->seat->opponent = NULL;
+        opponent->seat->last_opponent = NULL;
+        fight_reset(&opponent->seat->fight, &rng);       // Clear the opponent since the match is over
+        // Move the winning client to the end of the list
+        move_client_end(&top, opponent);
+        enqueue_waiting(opponent);
+        update_timeout(opponent);
+    }
+    if (p->name_set) {
+        broadcast(top, p, T_LEFT);
+    }
+}
+
+/* Decode binary input frames from p and run each one as the text
+ * command it stands for. A malformed frame drops the client.
+ */
+static void frame_binary(struct client *p, struct client *top) {
+    int start = 0;
+
+    while (!p->dead && start < p->rlen) {
+        unsigned char op = p->rbuf[start];
+        char line[RBUF_SIZE];
+
+        if (op == OP_NAME || op == OP_SPEAK) {
+            if (p->rlen - start < 2) {
+                break;
+            }
+            int len = (unsigned char)p->rbuf[start + 1];
+            if (2 + len > RBUF_SIZE) {
+                logmsg(LOG_DEBUG, EV_ERROR, "Oversized frame from fd %d", p->fd);
+                kill_client(p);
+                return;
+            }
+            if (p->rlen - start < 2 + len) {
+                break;
+            }
+            memcpy(line, p->rbuf + start + 2, len);
+            line[len] = '\0';
+            start += 2 + len;
+
+            if (!line_allowed(p)) {
+                continue;
+            }
+            if (op == OP_NAME && !p->name_set) {
+                processline(p, top, line);
+            } else if (op == OP_SPEAK && p->name_set) {
+                speak_frame(p, top, line);
+            }
+            continue;
+        }
+
+        start++;
+        if (op != OP_ATTACK && op != OP_POWERMOVE && op != OP_MUTE) {
+            logmsg(LOG_DEBUG, EV_ERROR, "Unknown opcode %d from fd %d", op, p->fd);
+            kill_client(p);
+            return;
+        }
+        if (p->name_set && line_allowed(p)) {
+            line[0] = op == OP_ATTACK ? 'a' : op == OP_POWERMOVE ? 'p' : 'm';
+            line[1] = '\0';
+            processline(p, top, line);
+        }
+    }
+
+    if (p->dead) {
+        return;
+    }
+    p->rlen -= start;
+    memmove(p->rbuf, p->rbuf + start, p->rlen);
+}
+
+/* Deliver the speech p was typing to its opponent and spectators,
+ * which ends the speech. The chat limit has already been checked.
+ */
+static void say(struct client *p, const char *line) {
+    char speech[SPEECH_MAX];
+
+    strncpy(speech, line, sizeof(speech) - 1);
+    speech[sizeof(speech) - 1] = '\0';
+    p->speaking = 0;
+    send_screen(p, T_SPOKE, SCR_STATUS | SCR_MENU, 0, speech);
+    send_screen(p->seat->opponent, T_TOLD, SCR_STATUS | SCR_WAIT, 0, speech);
+    spectate(p, T_SEE_TOLD, 0, speech);
+}
+
+/* OP_SPEAK carries the speak move and its text together, so they are
+ * applied as one: the chat limit is checked before the move is made,
+ * and a refused text costs no speech and leaves p at the menu rather
+ * than typing one.
+ */
+static void speak_frame(struct client *p, struct client *top, char *text) {
+    struct seat *s = p->seat;
+    char speak[] = "s";
+
+    if (p->in_game && s->fight.is_turn && fight_can_speak(&s->fight, &s->opponent->seat->fight)
+        && !ip_take(p->ip, 1)) {
+        STAT(chat_limited, 1);
+        send_screen(p, T_TOO_FAST, 0, 0, NULL);
+        return;
+    }
+    processline(p, top, speak);
+    if (p->speaking) {
+        say(p, text);
+    }
+}
+
+/* Run the game logic for one complete line of input from p. The line
+ * has its terminator stripped.
+ */
+static void processline(struct client *p, struct client *top, char *line) {
+    struct client *opp = p->seat != NULL ? p->seat->opponent : NULL;
+
+    if (!p->name_set) {
+        // Names are unique among everyone connected
+        char name[sizeof(p->name)];
+        strncpy(name, line, sizeof(name) - 1);
+        name[sizeof(name) - 1] = '\0';
+        if (name[0] == '\0') {
+            send_screen(p, T_PROMPT, 0, 0, NULL);
+            return;
+        }
+        if (profile_claim(p, name, 0) == -1) {
+            send_screen(p, T_NAME_TAKEN, 0, 0, name);
+            return;
+        }
+        memcpy(p->name, name, sizeof(p->name));
+        p->name_set = 1;
+        enqueue_waiting(p);
+
+        send_screen(p, T_WELCOME, 0, 0, NULL);
+        send_board(p);
+        broadcast(top, p, T_JOINS);
+
+        logmsg(LOG_INFO, EV_JOIN, "Adding client %s", p->name);
+        update_timeout(p);
+        return;
+    }
+
+    // Any line counts as activity for the lobby idle limit
+    update_timeout(p);
+
+    // "t name text" whispers, in the lobby or mid-match, unless the
+    // line is a speech being typed
+    if (line[0] == 't' && line[1] == ' ' && !p->speaking) {
+        whisper_command(p, line + 2);
+        return;
+    }
+
+    if (!p->in_game) {
+        // "w name" watches name's match, a bare "w" stops; "c name"
+        // challenges name, a bare "c" withdraws
+        if (line[0] == 'w' && (line[1] == '\0' || line[1] == ' ')) {
+            watch_command(p, line[1] != '\0' ? line + 2 : "");
+        } else if (line[0] == 'c' && (line[1] == '\0' || line[1] == ' ')) {
+            challenge_command(p, line[1] != '\0' ? line + 2 : "");
+        }
+        return;
+    }
+
+    if (p->speaking && p->seat->fight.is_turn) {
+        // The whole line is what they say, unless their address has
+        // been chatting too fast; then they stay at the prompt
+        if (!ip_take(p->ip, 1)) {
+            STAT(chat_limited, 1);
+            send_screen(p, T_TOO_FAST, 0, 0, NULL);
+            return;
+        }
+        say(p, line);
+        return;
+    }
+
+    enum fight_move move;
+    if (line[0] == 'a') {
+        move = FM_ATTACK;
+    } else if (line[0] == 'p') {
+        move = FM_POWERMOVE;
+    } else if (line[0] == 's') {
+        move = FM_SPEAK;
+    } else if (line[0] == 'm') {
+        move = FM_MUTE;
+    } else {
+        return;
+    }
+
+    struct fight_result res = fight_move(&p->seat->fight, &opp->seat->fight, move, &rng);
+    // Screens for a move that keeps the turn; muting also works out of turn
+    int flags = p->seat->fight.is_turn ? SCR_STATUS | SCR_MENU : SCR_WAIT;
+
+    switch (res.event) {
+    case FE_NONE:
+        return;
+    case FE_MUTED:
+    case FE_UNMUTED:
+        STAT(moves_mute, 1);
+        p->muted = p->seat->fight.muted;
+        send_screen(p, res.event == FE_MUTED ? T_MUTED : T_UNMUTED, flags, 0, NULL);
+        return;
+    case FE_SPEAK:
+        STAT(moves_speak, 1);
+        p->speaking = 1;
+        send_screen(p, T_SPEAK, 0, 0, NULL);
+        return;
+    case FE_NO_SPEAK:
+    case FE_SPOKEN_ENOUGH:
+        STAT(moves_speak, 1);
+        send_screen(p, res.event == FE_NO_SPEAK ? T_NO_SPEAK : T_SPOKEN_ENOUGH, flags, 0, NULL);
+        return;
+    case FE_HIT:
+        STAT(moves_attack, 1);
+        send_screen(p, T_HIT, SCR_STATUS | SCR_WAIT, res.damage, NULL);
+        send_screen(opp, T_GOT_HIT, SCR_STATUS | SCR_MENU, res.damage, NULL);
+        spectate(p, T_SEE_HIT, res.damage, NULL);
+        break;
+    case FE_POWER_HIT:
+        STAT(moves_powermove, 1);
+        send_screen(p, T_HIT, SCR_STATUS | SCR_WAIT, res.damage, NULL);
+        send_screen(opp, T_GOT_POWER, SCR_STATUS | SCR_MENU, res.damage, NULL);
+        spectate(p, T_SEE_POWER, res.damage, NULL);
+        break;
+    case FE_POWER_MISS:
+        STAT(moves_powermove, 1);
+        send_screen(p, T_MISS, SCR_STATUS | SCR_WAIT, 0, NULL);
+        send_screen(opp, T_GOT_MISS, SCR_STATUS | SCR_MENU, 0, NULL);
+        spectate(p, T_SEE_MISS, 0, NULL);
+        break;
+    }
+
+    // The turn has passed to opp
+    update_timeout(p);
+    update_timeout(opp);
+
+    if (res.won) {
+        send_screen(p, T_VICTORY, 0, 0, NULL);
+        send_screen(opp, T_DEFEAT, 0, 0, NULL);
+        end_match(&top, p, opp);
+    }
+}
+
+/* Format a log line into the ring without blocking. Lines below the
+ * log level are skipped, each thread may only emit LOG_RATE lines a
+ * second (errors excepted), and a full ring drops the line; both losses
+ * are counted and reported by the writer.
+ */
+static void logmsg(enum loglevel level, enum logevent event, const char *fmt, ...) {
+    if (level < log_level) {
+        return;
+    }
+
+    if (level < LOG_ERROR) {
+        uint64_t now = now_ns();
+        log_tokens += (now - log_refill) * (LOG_RATE / 1e9);
+        log_refill = now;
+        if (log_tokens > LOG_BURST) {
+            log_tokens = LOG_BURST;
+        }
+        if (log_tokens < 1) {
+            atomic_fetch_add_explicit(&log_suppressed, 1, memory_order_relaxed);
+            return;
+        }
+        log_tokens--;
+    }
+
+    size_t pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+    struct logslot *slot;
+    while (1) {
+        slot = &logring[pos & (LOG_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if ((ssize_t)(seq - pos) < 0) {
+            atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+        }
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+    va_end(ap);
+    clock_gettime(CLOCK_REALTIME_COARSE, &slot->when);
+    slot->level = level;
+    slot->event = event;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+/* Background writer: drain the log ring to stdout in batches, so a slow
+ * reader on the other end of stdout only ever stalls this thread.
+ */
+static void *run_logger(void *arg) {
+    static const char *levels[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+    static const char *events[] = { "server", "join", "leave", "match_start", "match_end", "slow", "timeout", "error" };
+    static char out[64 * 1024];
+    size_t tail = 0;
+    uint64_t dropped_seen = 0, suppressed_seen = 0, reported_at = 0;
+    (void)arg;
+
+    while (1) {
+        size_t n = 0;
+
+        while (n < sizeof(out) - LOG_LINE - 64) {
+            struct logslot *slot = &logring[tail & (LOG_SLOTS - 1)];
+            if (atomic_load_explicit(&slot->seq, memory_order_acquire) != tail + 1) {
+                break;
+            }
+            n += snprintf(out + n, sizeof(out) - n, "%ld.%03ld %s %s %s\n",
+                          (long)slot->when.tv_sec, slot->when.tv_nsec / 1000000,
+                          levels[slot->level], events[slot->event], slot->text);
+            atomic_store_explicit(&slot->seq, tail + LOG_SLOTS, memory_order_release);
+            tail++;
+        }
+
+        // Losses are summed up at most once a second
+        uint64_t dropped = atomic_load(&log_dropped), suppressed = atomic_load(&log_suppressed);
+        if ((dropped != dropped_seen || suppressed != suppressed_seen) &&
+            now_ns() - reported_at >= 1000000000) {
+            reported_at = now_ns();
+            n += snprintf(out + n, sizeof(out) - n, "logger: %llu lines dropped, %llu rate limited\n",
+                          (unsigned long long)(dropped - dropped_seen),
+                          (unsigned long long)(suppressed - suppressed_seen));
+            dropped_seen = dropped;
+            suppressed_seen = suppressed;
+        }
+
+        if (n == 0) {
+            struct timespec nap = { 0, 10 * 1000000 };
+            nanosleep(&nap, NULL);
+            continue;
+        }
+        for (size_t off = 0; off < n; ) {
+            ssize_t w = write(STDOUT_FILENO, out + off, n - off);
+            if (w == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            off += w;
+        }
+    }
+    return NULL;
+}
+
+ /* bind and listen, abort on error
+  * returns FD of listening socket
+  */
+int bindandlisten(void) {
+    struct sockaddr_in r;
+    int listenfd;
+
+    // The listening socket is drained in a loop, so it must not block
+    if ((listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    int yes = 1;
+    if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) == -1) {
+        perror("setsockopt");
+    }
+    // Every shard binds its own socket to the same port
+    if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int))) == -1) {
+        perror("setsockopt");
+    }
+    memset(&r, '\0', sizeof(r));
+    r.sin_family = AF_INET;
+    r.sin_addr.s_addr = INADDR_ANY;
+    r.sin_port = htons(PORT);
+
+    if (bind(listenfd, (struct sockaddr *)&r, sizeof r)) {
+        perror("bind");
+        exit(1);
+    }
+
+    if (listen(listenfd, listen_backlog)) {
+        perror("listen");
+        exit(1);
+    }
+    return listenfd;
+}
+
+/* Listen for stats requests on the loopback interface only.
+ * returns FD of listening socket
+ */
+static int bindstats(int port) {
+    struct sockaddr_in r;
+    int statsfd;
+
+    if ((statsfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    int yes = 1;
+    if ((setsockopt(statsfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) == -1) {
+        perror("setsockopt");
+    }
+    memset(&r, '\0', sizeof(r));
+    r.sin_family = AF_INET;
+    r.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    r.sin_port = htons(port);
+
+    if (bind(statsfd, (struct sockaddr *)&r, sizeof r)) {
+        perror("bind stats");
+        exit(1);
+    }
+    if (listen(statsfd, 10)) {
+        perror("listen");
+        exit(1);
+    }
+    return statsfd;
+}
+
+static int render_hist(char *buf, size_t size, const char *name, struct hist *h) {
+    return snprintf(buf, size,
+                    "%s_count %llu\n%s_p50 %llu\n%s_p99 %llu\n%s_p999 %llu\n%s_max %llu\n",
+                    name, (unsigned long long)h->count,
+                    name, (unsigned long long)hist_pct(h, 50),
+                    name, (unsigned long long)hist_pct(h, 99),
+                    name, (unsigned long long)hist_pct(h, 99.9),
+                    name, (unsigned long long)h->max);
+}
+
+/* Sum every shard's stats into one "name value" per line report. */
+static int render_stats(char *buf, size_t size) {
+    static const struct {
+        const char *name;
+        size_t off;
+    } counters[] = {
+        { "connections_accepted", offsetof(struct stats, accepted) },
+        { "connections_closed", offsetof(struct stats, closed) },
+        { "matches_started", offsetof(struct stats, matches_started) },
+        { "matches_ended", offsetof(struct stats, matches_ended) },
+        { "moves_attack", offsetof(struct stats, moves_attack) },
+        { "moves_powermove", offsetof(struct stats, moves_powermove) },
+        { "moves_speak", offsetof(struct stats, moves_speak) },
+        { "moves_mute", offsetof(struct stats, moves_mute) },
+        { "sends_dropped", offsetof(struct stats, sends_dropped) },
+        { "slow_consumers", offsetof(struct stats, slow_consumers) },
+        { "spectators_shed", offsetof(struct stats, spectators_shed) },
+        { "shard_handoffs", offsetof(struct stats, handoffs) },
+        { "connections_shed", offsetof(struct stats, shed) },
+        { "connections_refused_ip", offsetof(struct stats, refused_ip) },
+        { "lines_limited", offsetof(struct stats, lines_limited) },
+        { "chat_limited", offsetof(struct stats, chat_limited) },
+        { "timeouts_name", offsetof(struct stats, timeouts_name) },
+        { "timeouts_turn", offsetof(struct stats, timeouts_turn) },
+        { "timeouts_idle", offsetof(struct stats, timeouts_idle) },
+        { "io_syscalls", offsetof(struct stats, syscalls) },
+        { "clients", offsetof(struct stats, clients) },
+        { "waiting_queue_depth", offsetof(struct stats, waiting) },
+        { "spectators", offsetof(struct stats, spectators) },
+    };
+    static __thread struct hist handle, match, loop, wait, gap;
+    int n = 0;
+
+    for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+        int64_t total = 0;
+        for (int i = 0; i < nshards; i++) {
+            uint64_t *v = (uint64_t *)((char *)&shards[i].stats + counters[c].off);
+            total += (int64_t)__atomic_load_n(v, __ATOMIC_RELAXED);
+        }
+        n += snprintf(buf + n, size - n, "%s %lld\n", counters[c].name, (long long)total);
+    }
+
+    memset(&handle, 0, sizeof(handle));
+    memset(&match, 0, sizeof(match));
+    memset(&loop, 0, sizeof(loop));
+    memset(&wait, 0, sizeof(wait));
+    memset(&gap, 0, sizeof(gap));
+    for (int i = 0; i < nshards; i++) {
+        hist_merge(&handle, &shards[i].stats.handle_ns);
+        hist_merge(&match, &shards[i].stats.match_ns);
+        hist_merge(&loop, &shards[i].stats.loop_ns);
+        hist_merge(&wait, &shards[i].stats.match_wait_ns);
+        hist_merge(&gap, &shards[i].stats.match_gap);
+    }
+    n += render_hist(buf + n, size - n, "handleclient_ns", &handle);
+    n += render_hist(buf + n, size - n, "matchmaking_ns", &match);
+    n += render_hist(buf + n, size - n, "time_to_match_ns", &wait);
+    n += render_hist(buf + n, size - n, "match_rating_gap", &gap);
+    n += render_hist(buf + n, size - n, "loop_iteration_ns", &loop);
+    n += snprintf(buf + n, size - n, "log_dropped %llu\nlog_suppressed %llu\n",
+                  (unsigned long long)atomic_load(&log_dropped),
+                  (unsigned long long)atomic_load(&log_suppressed));
+    n += snprintf(buf + n, size - n, "mem_rss_bytes %lld\nclient_record_bytes %zu\nseat_record_bytes %zu\n",
+                  resident_bytes(), sizeof(struct client), sizeof(struct seat));
+    return n;
+}
+
+/* The process's resident memory, from /proc/self/statm.
+ * returns the size in bytes, or -1 if it could not be read
+ */
+static long long resident_bytes(void) {
+    char buf[128];
+    long long pages = -1;
+    int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n > 0) {
+        buf[n] = '\0';
+        if (sscanf(buf, "%*s %lld", &pages) != 1) {
+            return -1;
+        }
+    }
+    return pages < 0 ? -1 : pages * sysconf(_SC_PAGESIZE);
+}
+
+/* Answer every pending stats connection with one report and hang up. */
+static void serve_stats(int statsfd) {
+    char buf[STATS_BUF];
+    int fd;
+
+    while ((fd = accept(statsfd, NULL, NULL)) >= 0) {
+        int n = render_stats(buf, sizeof(buf));
+        if (send(fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL) != n) {
+            logmsg(LOG_WARN, EV_ERROR, "stats send: %m");
+        }
+        close(fd);
+    }
+}
+
+/* Player profiles outlive connections. Every shard shares one hash
+ * index of them, by name, under profile_lock; the lock is taken when a
+ * player names itself and when a match ends, never per move. A name
+ * gets a profile only once a client has claimed it, and the profile
+ * is dropped again when that client leaves without having played.
+ * One with a result lives as long as the server. Either way a client
+ * keeps a plain pointer to its own while connected.
+ *
+ * With -P, results also go to disk: end_match() only appends to an
+ * in-memory batch, which run_profiles() writes to an append-only log
+ * once every PROFILE_FLUSH_MS. Every SNAPSHOT_EVERY results it writes
+ * the whole table to a snapshot and empties the log. Startup maps the
+ * snapshot and replays whatever the log holds on top of it.
+ */
+static uint32_t profile_hash(const char *name) {
+    uint32_t h = 2166136261u;
+
+    while (*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h;
+}
+
+/* Look up the profile called name, creating it if needed. Called with
+ * profile_lock held.
+ */
+static struct profile *profile_find(const char *name) {
+    uint32_t h = profile_hash(name);
+
+    if (profile_buckets != 0) {
+        for (struct profile *x = profile_table[h & (profile_buckets - 1)]; x != NULL; x = x->hnext) {
+            if (!strcmp(x->name, name)) {
+                return x;
+            }
+        }
+    }
+
+    if (profile_count >= profile_buckets) {
+        // Keep chains short: double the index when it fills up
+        size_t buckets = profile_buckets ? profile_buckets * 2 : 1024;
+        struct profile **t = calloc(buckets, sizeof(*t));
+        if (!t) {
+            perror("calloc");
+            exit(1);
+        }
+        for (size_t i = 0; i < profile_buckets; i++) {
+            while (profile_table[i] != NULL) {
+                struct profile *x = profile_table[i];
+                profile_table[i] = x->hnext;
+                x->hnext = t[profile_hash(x->name) & (buckets - 1)];
+                t[profile_hash(x->name) & (buckets - 1)] = x;
+            }
+        }
+        free(profile_table);
+        profile_table = t;
+        profile_buckets = buckets;
+    }
+
+    if (profile_free == NULL) {
+        struct profile *slab = malloc(PROFILE_SLAB * sizeof(struct profile));
+        if (!slab) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int i = 0; i < PROFILE_SLAB; i++) {
+            slab[i].hnext = profile_free;
+            profile_free = &slab[i];
+        }
+    }
+    struct profile *x = profile_free;
+    profile_free = x->hnext;
+
+    strncpy(x->name, name, sizeof(x->name) - 1);
+    x->name[sizeof(x->name) - 1] = '\0';
+    x->wins = 0;
+    x->losses = 0;
+    x->rating = RATING_START;
+    x->rank = -1;
+    x->online = 0;
+    x->home = NULL;
+    x->client = NULL;
+    x->hnext = profile_table[h & (profile_buckets - 1)];
+    profile_table[h & (profile_buckets - 1)] = x;
+    profile_count++;
+    return x;
+}
+
+/* Unhash x and give it back to the slab. Called with profile_lock
+ * held, for a profile nobody holds and that has no results.
+ */
+static void profile_drop(struct profile *x) {
+    struct profile **pp = &profile_table[profile_hash(x->name) & (profile_buckets - 1)];
+
+    while (*pp != x) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = x->hnext;
+    x->hnext = profile_free;
+    profile_free = x;
+    profile_count--;
+}
+
+/* Move x up the leaderboard after its wins went up, entering it if it
+ * now beats the last row. Wins never go down, so nobody else's place
+ * can change. Called with profile_lock held.
+ */
+static void board_update(struct profile *x) {
+    int i = x->rank;
+
+    if (i == -1) {
+        if (board_len == BOARD_SIZE && x->wins <= board[BOARD_SIZE - 1]->wins) {
+            return;
+        }
+        if (board_len == BOARD_SIZE) {
+            board[BOARD_SIZE - 1]->rank = -1;
+            i = BOARD_SIZE - 1;
+        } else {
+            i = board_len++;
+        }
+    }
+    while (i > 0 && board[i - 1]->wins < x->wins) {
+        board[i] = board[i - 1];
+        board[i]->rank = i;
+        i--;
+    }
+    board[i] = x;
+    x->rank = i;
+}
+
+/* How many thousandths of a point a player is expected to score
+ * against one rated diff points higher, from the Elo curve every
+ * 25 points.
+ */
+static int elo_expect(int diff) {
+    static const short curve[] = {
+        500, 464, 429, 394, 360, 327, 297, 267, 240, 215, 192, 170, 151, 133, 118, 104, 91,
+        80, 70, 61, 53, 46, 40, 35, 31, 27, 23, 20, 17, 15, 13, 11, 10,
+    };
+
+    if (diff < 0) {
+        return 1000 - elo_expect(-diff);
+    }
+    if (diff >= 800) {
+        return curve[32];
+    }
+    int i = diff / 25, f = diff % 25;
+    return curve[i] + (curve[i + 1] - curve[i]) * f / 25;
+}
+
+/* Count one result. Called with profile_lock held. */
+static void profile_apply(struct profile *winner, struct profile *loser) {
+    // The less likely the win, the more points change hands
+    int delta = (RATING_K * (1000 - elo_expect(loser->rating - winner->rating)) + 500) / 1000;
+    if (delta < 1) {
+        delta = 1;
+    }
+    winner->rating += delta;
+    loser->rating -= delta;
+    winner->wins++;
+    loser->losses++;
+    board_update(winner);
+    if (winner->rank != -1 || loser->rank != -1) {
+        atomic_fetch_add(&board_version, 1);
+    }
+}
+
+/* The profile called name, or NULL. Called with profile_lock held. */
+static struct profile *profile_lookup(const char *name) {
+    char key[sizeof(((struct profile *)0)->name)];
+
+    if (profile_buckets == 0) {
+        return NULL;
+    }
+    strncpy(key, name, sizeof(key) - 1);
+    key[sizeof(key) - 1] = '\0';
+    for (struct profile *x = profile_table[profile_hash(key) & (profile_buckets - 1)]; x != NULL; x = x->hnext) {
+        if (!strcmp(x->name, key)) {
+            return x;
+        }
+    }
+    return NULL;
+}
+
+/* Take the name for p, which is not yet named, and its profile and
+ * rating with it. The profile index doubles as the index of who is
+ * connected: a profile is online while a client goes by its name, and
+ * says which shard's client that is, so commands can find any player
+ * with one hash lookup. force takes the name even if it is online,
+ * for clients arriving in a hot upgrade. A refused name creates no
+ * profile.
+ * returns 0, or -1 if another client already has the name
+ */
+static int profile_claim(struct client *p, const char *name, int force) {
+    pthread_mutex_lock(&profile_lock);
+    struct profile *x = profile_lookup(name);
+    if (x != NULL && x->online && !force) {
+        pthread_mutex_unlock(&profile_lock);
+        return -1;
+    }
+    if (x == NULL) {
+        x = profile_find(name);
+    }
+    x->online = 1;
+    x->home = self;
+    x->client = p;
+    p->profile = x;
+    p->rating = x->rating;
+    pthread_mutex_unlock(&profile_lock);
+    return 0;
+}
+
+/* p is disconnecting; its name is free again, and its profile goes
+ * too if p never finished a match.
+ */
+static void profile_release(struct client *p) {
+    struct profile *x = p->profile;
+
+    if (x == NULL) {
+        return;
+    }
+    p->profile = NULL;
+    pthread_mutex_lock(&profile_lock);
+    x->online = 0;
+    x->home = NULL;
+    x->client = NULL;
+    if (x->wins == 0 && x->losses == 0) {
+        profile_drop(x);
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/* p's name now belongs to the record where on this shard, or with
+ * where NULL to no shard while p moves between them.
+ */
+static void profile_locate(struct client *p, struct client *where) {
+    pthread_mutex_lock(&profile_lock);
+    p->profile->home = where != NULL ? self : NULL;
+    p->profile->client = where;
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/* The connected player called name, if it is one of this shard's
+ * clients. Only the home shard follows a profile's client pointer, and
+ * only it can free that client, so the pointer stays good after the
+ * lock is dropped.
+ * returns the client, or NULL
+ */
+static struct client *find_player(const char *name) {
+    struct client *c = NULL;
+
+    pthread_mutex_lock(&profile_lock);
+    struct profile *x = profile_lookup(name);
+    if (x != NULL && x->online && x->home == self) {
+        c = x->client;
+    }
+    pthread_mutex_unlock(&profile_lock);
+    return c != NULL && !c->dead ? c : NULL;
+}
+
+/* Record that the winner beat the loser, update both clients' ratings
+ * and queue the result for the log.
+ */
+static void profile_record(struct client *w, struct client *l) {
+    struct profile *winner = w->profile, *loser = l->profile;
+
+    pthread_mutex_lock(&profile_lock);
+    profile_apply(winner, loser);
+    w->rating = winner->rating;
+    l->rating = loser->rating;
+    if (profile_path != NULL) {
+        if (nresults == results_cap) {
+            size_t cap = results_cap ? results_cap * 2 : 256;
+            struct result_rec *r = realloc(results, cap * sizeof(*r));
+            if (!r) {
+                perror("realloc");
+                exit(1);
+            }
+            results = r;
+            results_cap = cap;
+        }
+        struct result_rec *r = &results[nresults++];
+        memset(r, 0, sizeof(*r));
+        r->magic = PROFILE_MAGIC;
+        memcpy(r->winner, winner->name, sizeof(r->winner));
+        memcpy(r->loser, loser->name, sizeof(r->loser));
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/* Queue the leaderboard for p. Each shard renders the board once per
+ * change and shares that msgbuf between all its clients, so showing it
+ * usually costs one atomic load.
+ */
+static void send_board(struct client *p) {
+    if (p->binary || p->dead) {
+        return;
+    }
+
+    unsigned version = atomic_load(&board_version);
+    if (board_msg == NULL || board_msg_version != version) {
+        struct profile rows[BOARD_SIZE];
+        int n;
+
+        pthread_mutex_lock(&profile_lock);
+        version = atomic_load(&board_version);
+        for (n = 0; n < board_len; n++) {
+            rows[n] = *board[n];
+        }
+        pthread_mutex_unlock(&profile_lock);
+
+        if (board_msg != NULL) {
+            msgbuf_put(board_msg);
+        }
+        size_t size = 32 + BOARD_SIZE * (sizeof(rows[0].name) + 64);
+        board_msg = msgbuf_alloc(size);
+        board_msg_version = version;
+        int len = n ? snprintf(board_msg->data, size, "\nTop players:\n") : 0;
+        for (int i = 0; i < n; i++) {
+            len += snprintf(board_msg->data + len, size - len, "%d. %s, %u won, %u lost, rating %d\n",
+                            i + 1, rows[i].name, rows[i].wins, rows[i].losses, rows[i].rating);
+        }
+        board_msg->len = len;
+    }
+    queue_msgbuf(p, board_msg);
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *s = buf;
+
+    while (len > 0) {
+        ssize_t w = write(fd, s, len);
+        if (w == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        s += w;
+        len -= w;
+    }
+    return 0;
+}
+
+/* Start the log over for generation gen. */
+static int profile_log_reset(uint64_t gen) {
+    struct log_header h;
+
+    memset(&h, 0, sizeof(h));
+    h.magic = PROFILE_MAGIC;
+    h.gen = gen;
+    if (ftruncate(profile_log, 0) == -1 || write_all(profile_log, &h, sizeof(h)) == -1) {
+        return -1;
+    }
+    return fdatasync(profile_log);
+}
+
+/* Move a profile file the server cannot use to path.old, so that
+ * nothing in it is lost, and say so. An earlier .old is never
+ * overwritten; the server stops instead.
+ */
+static void profile_set_aside(const char *path, const char *why) {
+    char old[PATH_MAX];
+
+    if (snprintf(old, sizeof(old), "%s.old", path) >= (int)sizeof(old)) {
+        fprintf(stderr, "%s: path too long\n", path);
+        exit(1);
+    }
+    if (access(old, F_OK) == 0) {
+        fprintf(stderr, "%s %s, and %s is in the way of moving it aside\n", path, why, old);
+        exit(1);
+    }
+    if (rename(path, old) == -1) {
+        perror(old);
+        exit(1);
+    }
+    logmsg(LOG_WARN, EV_SERVER, "%s %s; moved it to %s", path, why, old);
+}
+
+/* Rebuild the profiles from disk before any shard runs. The snapshot
+ * is mapped and indexed in place; the log is replayed on top of it if
+ * it belongs to the same generation, and dropped if it is the one the
+ * snapshot already folded in. A file in an older format, or a log that
+ * fits neither, is set aside rather than overwritten. A torn record at
+ * the end of the log is cut off.
+ */
+static void profiles_load(void) {
+    char path[PATH_MAX];
+    struct stat st;
+    uint64_t gen = 0;
+    size_t loaded = 0, replayed = 0;
+
+    snprintf(path, sizeof(path), "%s.snap", profile_path);
+    int fd = open(path, O_RDONLY);
+    if (fd != -1) {
+        if (fstat(fd, &st) == -1) {
+            perror("fstat");
+            exit(1);
+        }
+        const struct snap_header *h = NULL;
+        size_t body = 0;
+        if ((size_t)st.st_size >= sizeof(*h)) {
+            h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (h == MAP_FAILED) {
+                perror("mmap");
+                exit(1);
+            }
+            body = st.st_size - sizeof(*h);
+        }
+        if (h == NULL || h->magic != PROFILE_MAGIC || body % sizeof(struct snap_rec) != 0
+            || h->count != body / sizeof(struct snap_rec)) {
+            profile_set_aside(path, "is not a snapshot in this version's format");
+        } else {
+            const struct snap_rec *rec = (const struct snap_rec *)(h + 1);
+            for (uint32_t i = 0; i < h->count; i++) {
+                profile_restore(&rec[i]);
+            }
+            gen = h->gen;
+            loaded = h->count;
+        }
+        if (h != NULL) {
+            munmap((void *)h, st.st_size);
+        }
+        close(fd);
+    }
+
+    snprintf(path, sizeof(path), "%s.log", profile_path);
+    if ((profile_log = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) == -1) {
+        perror(path);
+        exit(1);
+    }
+    struct log_header lh;
+    ssize_t got = read(profile_log, &lh, sizeof(lh));
+    int fresh = got == 0;
+    if (got != 0 && (got != sizeof(lh) || lh.magic != PROFILE_MAGIC)) {
+        profile_set_aside(path, "is not a results log in this version's format");
+        fresh = 1;
+    } else if (got != 0 && lh.gen + 1 == gen) {
+        // A crash between writing the snapshot and starting the log over
+        logmsg(LOG_INFO, EV_SERVER, "%s is already in %s.snap; starting it over", path, profile_path);
+        fresh = 1;
+    } else if (got != 0 && lh.gen != gen) {
+        profile_set_aside(path, "does not continue the snapshot");
+        fresh = 1;
+    }
+    if (fresh) {
+        close(profile_log);
+        if ((profile_log = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) == -1
+            || profile_log_reset(gen) == -1) {
+            perror(path);
+            exit(1);
+        }
+    } else {
+        struct result_rec r;
+        off_t good = sizeof(lh);
+        while (read(profile_log, &r, sizeof(r)) == sizeof(r) && r.magic == PROFILE_MAGIC) {
+            r.winner[sizeof(r.winner) - 1] = '\0';
+            r.loser[sizeof(r.loser) - 1] = '\0';
+            profile_apply(profile_find(r.winner), profile_find(r.loser));
+            good += sizeof(r);
+            replayed++;
+        }
+        if (fstat(profile_log, &st) == 0 && st.st_size > good) {
+            logmsg(LOG_WARN, EV_SERVER, "%s: cutting off %lld bytes of torn record", path, (long long)(st.st_size - good));
+        }
+        if (ftruncate(profile_log, good) == -1) {
+            perror(path);
+            exit(1);
+        }
+    }
+    profile_gen = gen;
+    results_logged = replayed;
+    logmsg(LOG_INFO, EV_SERVER, "Loaded %zu profiles and %zu logged results from %s", loaded, replayed, profile_path);
+}
+
+/* Write the table out as snapshot generation gen, atomically replacing
+ * the previous one.
+ */
+static int write_snapshot(struct snap_rec *recs, size_t count, uint64_t gen) {
+    char path[PATH_MAX], tmp[PATH_MAX];
+    struct snap_header h;
+
+    snprintf(path, sizeof(path), "%s.snap", profile_path);
+    snprintf(tmp, sizeof(tmp), "%s.snap.tmp", profile_path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    memset(&h, 0, sizeof(h));
+    h.magic = PROFILE_MAGIC;
+    h.count = count;
+    h.gen = gen;
+    if (write_all(fd, &h, sizeof(h)) == -1 || write_all(fd, recs, count * sizeof(*recs)) == -1
+        || fsync(fd) == -1) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    return rename(tmp, path);
+}
+
+static void snap_copy(struct snap_rec *rec, const struct profile *x) {
+    memcpy(rec->name, x->name, sizeof(rec->name));
+    rec->wins = x->wins;
+    rec->losses = x->losses;
+    rec->rating = x->rating;
+}
+
+/* Copy every profile out, leaderboard rows first and in order so that
+ * loading them breaks ties the same way. Called with profile_lock held.
+ * returns the copies, or NULL if out of memory
+ */
+static struct snap_rec *snap_collect(size_t *count) {
+    struct snap_rec *snap = calloc(profile_count ? profile_count : 1, sizeof(*snap));
+    size_t n = 0;
+
+    if (snap == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < board_len; i++) {
+        snap_copy(&snap[n++], board[i]);
+    }
+    for (size_t i = 0; i < profile_buckets; i++) {
+        for (struct profile *x = profile_table[i]; x != NULL; x = x->hnext) {
+            if (x->rank == -1 && x->wins + x->losses != 0) {
+                snap_copy(&snap[n++], x);
+            }
+        }
+    }
+    *count = n;
+    return snap;
+}
+
+/* Take over one profile from a snapshot or a hot upgrade. */
+static void profile_restore(const struct snap_rec *rec) {
+    struct profile *x = profile_find(rec->name);
+    x->wins = rec->wins;
+    x->losses = rec->losses;
+    x->rating = rec->rating;
+    board_update(x);
+}
+
+/* Background writer for -P: append each batch of results to the log,
+ * and every SNAPSHOT_EVERY results fold the log into a new snapshot.
+ * The snapshot is taken together with the batch, so it holds exactly
+ * what the log does once the batch is written; it goes to disk before
+ * the log is emptied, and a crash in between leaves a log of an older
+ * generation that the next start ignores.
+ */
+static void *run_profiles(void *arg) {
+    struct result_rec *batch = NULL;
+    size_t batch_cap = 0;
+    (void)arg;
+
+    while (1) {
+        struct timespec nap = { PROFILE_FLUSH_MS / 1000, PROFILE_FLUSH_MS % 1000 * 1000000L };
+        nanosleep(&nap, NULL);
+
+        pthread_mutex_lock(&profile_io_lock);
+        pthread_mutex_lock(&profile_lock);
+        struct result_rec *r = results;
+        size_t n = nresults, cap = results_cap;
+        results = batch;
+        results_cap = batch_cap;
+        nresults = 0;
+        batch = r;
+        batch_cap = cap;
+
+        struct snap_rec *snap = NULL;
+        size_t count = 0;
+        if (n > 0 && results_logged + n >= SNAPSHOT_EVERY) {
+            snap = snap_collect(&count);
+        }
+        pthread_mutex_unlock(&profile_lock);
+
+        if (n == 0) {
+            pthread_mutex_unlock(&profile_io_lock);
+            continue;
+        }
+        if (write_all(profile_log, batch, n * sizeof(*batch)) == -1 || fdatasync(profile_log) == -1) {
+            logmsg(LOG_ERROR, EV_ERROR, "profile log: %m");
+        }
+        results_logged += n;
+
+        if (snap != NULL) {
+            if (write_snapshot(snap, count, profile_gen + 1) == -1) {
+                logmsg(LOG_ERROR, EV_ERROR, "profile snapshot: %m");
+            } else {
+                profile_gen++;
+                results_logged = 0;
+                if (profile_log_reset(profile_gen) == -1) {
+                    logmsg(LOG_ERROR, EV_ERROR, "profile log: %m");
+                }
+                logmsg(LOG_INFO, EV_SERVER, "Wrote a snapshot of %zu profiles", count);
+            }
+            free(snap);
+        }
+        pthread_mutex_unlock(&profile_io_lock);
+    }
+    return NULL;
+}
+
+/* Hand out a client record from the slab, carving a new slab of
+ * CLIENT_SLAB records when the free list runs dry. Records are never
+ * returned to malloc, so joins and leaves cost no allocator calls once
+ * the server has warmed up.
+ */
+static struct client *client_alloc(void) {
+    if (client_freelist == NULL) {
+        struct client *slab = malloc(CLIENT_SLAB * sizeof(struct client));
+        if (!slab) {
+            return NULL;
+        }
+        for (int i = 0; i < CLIENT_SLAB; i++) {
+            slab[i].next = client_freelist;
+            client_freelist = &slab[i];
+        }
+    }
+    struct client *p = client_freelist;
+    client_freelist = p->next;
+    return p;
+}
+
+static void client_free(struct client *p) {
+    p->next = client_freelist;
+    client_freelist = p;
+}
+
+/* Record p in the fd-indexed lookup table, growing it as needed.
+ * returns 0 on success, -1 if the table could not grow
+ */
+static int fdtable_set(int fd, struct client *p) {
+    if (fd >= fdtable_size) {
+        int size = fdtable_size ? fdtable_size : 1024;
+        while (size <= fd) {
+            size *= 2;
+        }
+        struct client **t = realloc(fdtable, size * sizeof(*t));
+        if (!t) {
+            return -1;
+        }
+        memset(t + fdtable_size, 0, (size - fdtable_size) * sizeof(*t));
+        fdtable = t;
+        fdtable_size = size;
+    }
+    fdtable[fd] = p;
+    return 0;
+}
+
+/* Set up a client record for fd and append it to the list.
+ */
+static struct client *newclient(struct client *top, int fd, struct in_addr addr) {
+    struct client *p = client_alloc();
+    if (!p || fdtable_set(fd, p) == -1) {
+        perror("malloc");
+        exit(1);
+    }
+
+    // Initialize the new client's attributes
+    p->fd = fd;
+    p->ipaddr = addr;
+    p->ip = NULL;
+    p->next = NULL;
+    p->in_game = 0; // Initially not in a game
+    p->name[0] = '\0'; // Set the name to an empty string
+    p->name_set = 0;
+    p->speaking = 0;
+    p->muted = 0;
+    p->seat = NULL; // Attached once queued
+    p->waiting = 0;
+    p->out_head = NULL;
+    p->out_tail = NULL;
+    p->out_off = 0;
+    p->out_bytes = 0;
+    p->out_blocked = 0;
+    p->flush_pending = 0;
+    p->dead = 0;
+    p->rbuf = NULL;
+    p->rlen = 0;
+    p->rskip = 0;
+    p->timer.pprev = NULL;
+    p->timeout = TO_NONE;
+    p->binary = 0;
+    p->inflight = 0;
+    p->zombie = 0;
+    p->sendreq = NULL;
+    p->migrate_to = NULL;
+    p->profile = NULL;
+    p->rating = RATING_START;
+    p->index = -1;
+    update_timeout(p);
+    STAT(clients, 1);
+
+    // The dummy head's prev always points at the last client
+    p->prev = top->prev;
+    top->prev->next = p;
+    top->prev = p;
+
+    return p; 
+}
+
+static struct client *addclient(struct client *top, int fd, struct in_addr addr) {
+    struct client *p = newclient(top, fd, addr);
+
+    // Send a welcome message to the client asking for their name
+    send_screen(p, T_PROMPT, 0, 0, NULL);
+    return p;
+}
+
+static struct client *removeclient(struct client *top, int fd) {
+    struct client *cur = fd < fdtable_size ? fdtable[fd] : NULL;
+
+    if (cur == NULL) {
+        // Client not found
+        return top;
+    }
+
+    cur->prev->next = cur->next;
+    if (cur->next != NULL) {
+        cur->next->prev = cur->prev;
+    } else {
+        top->prev = cur->prev;
+    }
+    fdtable[fd] = NULL;
+    dequeue_waiting(cur);
+    unwatch(cur);
+    if (cur->seat != NULL) {
+        seat_free(cur->seat);
+        cur->seat = NULL;
+    }
+    unlink_flush(cur);
+    timer_cancel(&cur->timer);
+    STAT(clients, -1);
+
+    if (cur->inflight > 0) {
+        // The kernel still holds io_uring requests naming this record
+        // and maybe its output; the last completion frees both
+        cur->zombie = 1;
+        return top;
+    }
+    client_destroy(cur);
+    return top;
+}
+
+/* Drop whatever p still had queued, which will never be sent, and
+ * recycle the record.
+ */
+static void client_destroy(struct client *p) {
+    while (p->out_head != NULL) {
+        struct outseg *seg = p->out_head;
+        p->out_head = seg->next;
+        outseg_free(seg);
+        STAT(sends_dropped, 1);
+    }
+    if (p->rbuf != NULL) {
+        rbuf_free(p->rbuf);
+    }
+    client_free(p);
+}
+
+
+/* A msgbuf with room for size bytes, holding a single reference. The
+ * caller renders into data and sets len.
+ */
+static struct msgbuf *msgbuf_alloc(size_t size) {
+    struct msgbuf *m = malloc(sizeof(struct msgbuf) + size);
+    if (!m) {
+        perror("malloc");
+        exit(1);
+    }
+    m->refs = 1;
+    m->len = 0;
+    return m;
+}
+
+static void msgbuf_put(struct msgbuf *m) {
+    if (--m->refs == 0) {
+        free(m);
+    }
+}
+
+static struct outseg *outseg_alloc(void) {
+    if (outseg_freelist == NULL) {
+        struct outseg *slab = malloc(OUTSEG_SLAB * sizeof(struct outseg));
+        if (!slab) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int i = 0; i < OUTSEG_SLAB; i++) {
+            slab[i].next = outseg_freelist;
+            outseg_freelist = &slab[i];
+        }
+    }
+    struct outseg *seg = outseg_freelist;
+    outseg_freelist = seg->next;
+    return seg;
+}
+
+/* Drop the segment's message reference and recycle the segment. */
+static void outseg_free(struct outseg *seg) {
+    msgbuf_put(seg->m);
+    seg->next = outseg_freelist;
+    outseg_freelist = seg;
+}
+
+/* An input buffer of RBUF_SIZE bytes from this shard's pool. Free
+ * buffers are chained through their first bytes.
+ */
+static char *rbuf_alloc(void) {
+    if (rbuf_freelist == NULL) {
+        char *slab = malloc((size_t)RBUF_SLAB * RBUF_SIZE);
+        if (!slab) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int i = 0; i < RBUF_SLAB; i++) {
+            char *b = slab + (size_t)i * RBUF_SIZE;
+            memcpy(b, &rbuf_freelist, sizeof(rbuf_freelist));
+            rbuf_freelist = b;
+        }
+    }
+    char *b = rbuf_freelist;
+    memcpy(&rbuf_freelist, b, sizeof(rbuf_freelist));
+    return b;
+}
+
+static void rbuf_free(char *b) {
+    memcpy(b, &rbuf_freelist, sizeof(rbuf_freelist));
+    rbuf_freelist = b;
+}
+
+static struct match *match_alloc(void) {
+    if (match_freelist == NULL) {
+        struct match *slab = malloc(MATCH_SLAB * sizeof(struct match));
+        if (!slab) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int i = 0; i < MATCH_SLAB; i++) {
+            slab[i].next_free = match_freelist;
+            match_freelist = &slab[i];
+        }
+    }
+    struct match *m = match_freelist;
+    match_freelist = m->next_free;
+    m->watchers = NULL;
+    return m;
+}
+
+static void match_free(struct match *m) {
+    m->next_free = match_freelist;
+    match_freelist = m;
+}
+
+/* p's seat, taken from this shard's pool if it has none yet. */
+static struct seat *seat_attach(struct client *p) {
+    if (p->seat != NULL) {
+        return p->seat;
+    }
+    if (seat_freelist == NULL) {
+        struct seat *slab = malloc(SEAT_SLAB * sizeof(struct seat));
+        if (!slab) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int i = 0; i < SEAT_SLAB; i++) {
+            slab[i].next_free = seat_freelist;
+            seat_freelist = &slab[i];
+        }
+    }
+    struct seat *s = seat_freelist;
+    seat_freelist = s->next_free;
+    memset(s, 0, sizeof(*s));
+    s->fight.muted = p->muted;
+    p->seat = s;
+    return s;
+}
+
+/* Give p's seat back once p is not queued, playing, watching or
+ * challenging anyone.
+ */
+static void seat_release(struct client *p) {
+    struct seat *s = p->seat;
+
+    if (s == NULL || p->waiting || p->in_game || s->watching != NULL || s->challenged[0] != '\0') {
+        return;
+    }
+    seat_free(s);
+    p->seat = NULL;
+}
+
+static void seat_free(struct seat *s) {
+    s->next_free = seat_freelist;
+    seat_freelist = s;
+}
+
+/* Queue a reference to m on p's output. Nothing is written here; the
+ * bytes go out when the flush list is processed or the socket reports
+ * that it is writable again. A client whose socket is full and whose
+ * backlog passes the high-water mark is too slow to keep up and is
+ * disconnected.
+ */
+static void queue_msgbuf(struct client *p, struct msgbuf *m) {
+    if (p->dead) {
+        STAT(sends_dropped, 1);
+        return;
+    }
+    if (m->len == 0) {
+        return;
+    }
+
+    struct outseg *seg = outseg_alloc();
+    seg->next = NULL;
+    seg->m = m;
+    m->refs++;
+
+    if (p->out_tail != NULL) {
+        p->out_tail->next = seg;
+    } else {
+        p->out_head = seg;
+    }
+    p->out_tail = seg;
+    p->out_bytes += m->len;
+
+    if (p->out_blocked && p->out_bytes > outq_highwater) {
+        logmsg(LOG_WARN, EV_SLOW, "Dropping slow client %s (%zu bytes queued)", p->name, p->out_bytes);
+        STAT(slow_consumers, 1);
+        kill_client(p);
+        return;
+    }
+
+    if (!p->flush_pending) {
+        p->flush_pending = 1;
+        p->flush_prev = NULL;
+        p->flush_next = flush_list;
+        if (flush_list != NULL) {
+            flush_list->flush_prev = p;
+        }
+        flush_list = p;
+    }
+}
+
+/* Compile src into t. A slot is written {name}; everything else is
+ * copied through as is. Templates are fixed at build time, so a bad
+ * one is fatal.
+ */
+static void tpl_compile(struct tpl *t, const char *src) {
+    const char *p = src;
+
+    t->nseg = 0;
+    t->lit_len = 0;
+    t->nint = 0;
+    while (*p) {
+        if (t->nseg == TPL_SEGS) {
+            fprintf(stderr, "template too long: %s\n", src);
+            exit(1);
+        }
+        if (*p != '{') {
+            int len = strcspn(p, "{");
+            t->seg[t->nseg].lit = p;
+            t->seg[t->nseg].len = len;
+            t->nseg++;
+            t->lit_len += len;
+            p += len;
+            continue;
+        }
+
+        const char *end = strchr(p, '}');
+        int slot = 0;
+        while (end != NULL && slot < SL_COUNT) {
+            if ((int)strlen(slot_names[slot]) == end - p - 1 && !strncmp(slot_names[slot], p + 1, end - p - 1)) {
+                break;
+            }
+            slot++;
+        }
+        if (end == NULL || slot == SL_COUNT) {
+            fprintf(stderr, "bad template slot: %s\n", p);
+            exit(1);
+        }
+        t->seg[t->nseg].lit = NULL;
+        t->seg[t->nseg].slot = slot;
+        t->nseg++;
+        if (slot >= SL_HP) {
+            t->nint++;
+        }
+        p = end + 1;
+    }
+}
+
+static void tpl_init(void) {
+    for (int i = 0; i < T_COUNT; i++) {
+        tpl_compile(&tpls[i], tpl_src[i]);
+    }
+}
+
+/* Write n in decimal at out and return the end of it. */
+static char *fmt_int(char *out, int n) {
+    char digits[INT_CHARS];
+    unsigned int u = n < 0 ? -(unsigned int)n : (unsigned int)n;
+    int len = 0;
+
+    if (n < 0) {
+        *out++ = '-';
+    }
+    do {
+        digits[len++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    while (len) {
+        *out++ = digits[--len];
+    }
+    return out;
+}
+
+/* Upper bound on the rendered size of t. */
+static size_t tpl_size(const struct tpl *t, const union slotval *v) {
+    size_t size = t->lit_len + (size_t)t->nint * INT_CHARS;
+    for (int i = 0; i < t->nseg; i++) {
+        if (t->seg[i].lit == NULL && t->seg[i].slot < SL_HP) {
+            size += strlen(v[t->seg[i].slot].s);
+        }
+    }
+    return size;
+}
+
+static char *tpl_render(char *out, const struct tpl *t, const union slotval *v) {
+    for (int i = 0; i < t->nseg; i++) {
+        if (t->seg[i].lit != NULL) {
+            memcpy(out, t->seg[i].lit, t->seg[i].len);
+            out += t->seg[i].len;
+        } else if (t->seg[i].slot < SL_HP) {
+            size_t len = strlen(v[t->seg[i].slot].s);
+            memcpy(out, v[t->seg[i].slot].s, len);
+            out += len;
+        } else {
+            out = fmt_int(out, v[t->seg[i].slot].n);
+        }
+    }
+    return out;
+}
+
+static const struct fighter no_fight;   // what a client without a seat shows
+
+/* Render the screen p sees: the header template, then depending on
+ * flags p's status block and either the move menu or the waiting line.
+ * The pieces are rendered straight into one msgbuf.
+ */
+static struct msgbuf *render_text(struct client *p, enum tplid header, int flags, int dmg, const char *text) {
+    struct client *opp = p->seat != NULL ? p->seat->opponent : NULL;
+    const struct fighter *f = p->seat != NULL ? &p->seat->fight : &no_fight;
+    union slotval v[SL_COUNT];
+    enum tplid parts[4];
+    int nparts = 0;
+
+    v[SL_NAME].s = p->name;
+    v[SL_OPP].s = opp != NULL ? opp->name : "";
+    v[SL_TEXT].s = text != NULL ? text : "";
+    v[SL_HP].n = f->hitpoints;
+    v[SL_PM].n = f->power_moves;
+    v[SL_OPP_HP].n = opp != NULL ? opp->seat->fight.hitpoints : 0;
+    v[SL_DMG].n = dmg;
+
+    parts[nparts++] = header;
+    if (flags & SCR_STATUS) {
+        parts[nparts++] = f->power_moves > 0 ? T_STATUS : T_STATUS_NOPM;
+    }
+    if (flags & SCR_MENU) {
+        // Menus without (p)owermove and (s)peak follow T_MENU in that order
+        parts[nparts++] = T_MENU + (f->power_moves == 0) + 2 * (f->speak_count > 3);
+    }
+    if (flags & SCR_WAIT) {
+        parts[nparts++] = T_WAIT;
+    }
+
+    size_t size = 0;
+    for (int i = 0; i < nparts; i++) {
+        size += tpl_size(&tpls[parts[i]], v);
+    }
+    struct msgbuf *m = msgbuf_alloc(size);
+    char *out = m->data;
+    for (int i = 0; i < nparts; i++) {
+        out = tpl_render(out, &tpls[parts[i]], v);
+    }
+    m->len = out - m->data;
+    return m;
+}
+
+static unsigned char frame_byte(int n) {
+    return n < 0 ? 0 : n > 255 ? 255 : n;
+}
+
+/* The binary protocol's form of the same screen: a fixed header with
+ * the numbers, followed by whatever text the frame type carries.
+ */
+static struct msgbuf *render_frame(struct client *p, enum tplid header, int flags, int dmg, const char *text) {
+    struct client *opp = p->seat != NULL ? p->seat->opponent : NULL;
+    const struct fighter *f = p->seat != NULL ? &p->seat->fight : &no_fight;
+    const char *s = "";
+
+    if (tpl_frames[header].carries == SL_NAME) {
+        s = p->name;
+    } else if (tpl_frames[header].carries == SL_OPP && opp != NULL) {
+        s = opp->name;
+    } else if (tpl_frames[header].carries == SL_TEXT && text != NULL) {
+        s = text;
+    }
+    size_t len = strlen(s);
+    if (len > 255) {
+        len = 255;
+    }
+
+    struct msgbuf *m = msgbuf_alloc(FR_HEADER + len);
+    if (tpl_frames[header].type == 0) {
+        return m;    // len 0: nothing is queued
+    }
+
+    unsigned char *d = (unsigned char *)m->data;
+    d[0] = tpl_frames[header].type;
+    d[1] = 0;
+    d[2] = d[3] = d[4] = 0;
+    if (flags & SCR_STATUS) {
+        d[1] |= FRF_STATUS;
+        d[2] = frame_byte(f->hitpoints);
+        d[3] = frame_byte(f->power_moves);
+        d[4] = frame_byte(opp != NULL ? opp->seat->fight.hitpoints : 0);
+    }
+    if (flags & SCR_MENU) {
+        d[1] |= FRF_TURN;
+        if (f->power_moves > 0) {
+            d[1] |= FRF_CAN_POWER;
+        }
+        if (opp != NULL && fight_can_speak(f, &opp->seat->fight)) {
+            d[1] |= FRF_CAN_SPEAK;
+        }
+    }
+    if (flags & SCR_WAIT) {
+        d[1] |= FRF_WAIT;
+    }
+    d[5] = frame_byte(dmg);
+    d[6] = len;
+    memcpy(d + FR_HEADER, s, len);
+    m->len = FR_HEADER + len;
+    return m;
+}
+
+/* Render a screen as p's protocol wants it. */
+static struct msgbuf *render_screen(struct client *p, enum tplid header, int flags, int dmg, const char *text) {
+    if (p->binary) {
+        return render_frame(p, header, flags, dmg, text);
+    }
+    return render_text(p, header, flags, dmg, text);
+}
+
+/* Render a screen for p alone and queue it. */
+static void send_screen(struct client *p, enum tplid header, int flags, int dmg, const char *text) {
+    if (p->dead) {
+        STAT(sends_dropped, 1);
+        return;
+    }
+    struct msgbuf *m = render_screen(p, header, flags, dmg, text);
+    queue_msgbuf(p, m);
+    msgbuf_put(m);
+}
+
+/* Show viewer subject's header screen in viewer's protocol. A screen
+ * with no binary frame sends binary viewers nothing.
+ */
+static void send_about(struct client *viewer, struct client *subject, enum tplid header, int dmg, const char *text) {
+    if (viewer->dead) {
+        STAT(sends_dropped, 1);
+        return;
+    }
+    struct msgbuf *m = viewer->binary ? render_frame(subject, header, 0, dmg, text)
+                                      : render_text(subject, header, 0, dmg, text);
+    queue_msgbuf(viewer, m);
+    msgbuf_put(m);
+}
+
+static void unlink_flush(struct client *p) {
+    if (!p->flush_pending) {
+        return;
+    }
+    if (p->flush_prev != NULL) {
+        p->flush_prev->flush_next = p->flush_next;
+    } else {
+        flush_list = p->flush_next;
+    }
+    if (p->flush_next != NULL) {
+        p->flush_next->flush_prev = p->flush_prev;
+    }
+    p->flush_pending = 0;
+}
+
+/* Write as much of p's queued output as the socket will take. Whatever
+ * is left stays queued until epoll reports EPOLLOUT.
+ */
+static void flush_client(struct client *p) {
+    struct iovec iov[OUT_IOV];
+
+#ifdef HAVE_URING
+    if (use_uring) {
+        uring_send(p);
+        return;
+    }
+#endif
+    while (p->out_head != NULL && !p->dead) {
+        int n = 0;
+        struct outseg *seg = p->out_head;
+        size_t off = p->out_off;
+        for (; seg != NULL && n < OUT_IOV; seg = seg->next, n++) {
+            iov[n].iov_base = seg->m->data + off;
+            iov[n].iov_len = seg->m->len - off;
+            off = 0;
+        }
+
+        ssize_t written = writev(p->fd, iov, n);
+        STAT(syscalls, 1);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                kill_client(p);
+            } else if (p->out_bytes > outq_highwater) {
+                logmsg(LOG_WARN, EV_SLOW, "Dropping slow client %s (%zu bytes queued)", p->name, p->out_bytes);
+                STAT(slow_consumers, 1);
+                kill_client(p);
+            } else {
+                p->out_blocked = 1;
+            }
+            return;
+        }
+        out_advance(p, written);
+    }
+}
+
+/* Drop the first written bytes of p's output queue, which the socket
+ * has taken.
+ */
+static void out_advance(struct client *p, size_t written) {
+    p->out_bytes -= written;
+    while (written > 0) {
+        struct outseg *seg = p->out_head;
+        size_t left = seg->m->len - p->out_off;
+        if (written < left) {
+            p->out_off += written;
+            break;
+        }
+        written -= left;
+        p->out_off = 0;
+        p->out_head = seg->next;
+        outseg_free(seg);
+    }
+    if (p->out_head == NULL) {
+        p->out_tail = NULL;
+        p->out_blocked = 0;
+    }
+}
+
+/* Flush every client that had output queued since the last pass. */
+static void flush_output(void) {
+    while (flush_list != NULL) {
+        struct client *p = flush_list;
+        unlink_flush(p);
+        flush_client(p);
+    }
+}
+
+/* Mark p for removal. The client is only torn down by reap_clients()
+ * so that pointers held further up the call stack stay valid.
+ */
+static void kill_client(struct client *p) {
+    if (p->dead) {
+        return;
+    }
+    p->dead = 1;
+    p->dead_next = dead_list;
+    dead_list = p;
+}
+
+static void reap_clients(struct client *top) {
+    while (dead_list != NULL) {
+        struct client *p = dead_list;
+        dead_list = p->dead_next;
+
+        disconnect_client(p, top);
+        if (p->name_set) {
+            logmsg(LOG_INFO, EV_LEAVE, "Removing client %s", p->name);
+        } else {
+            // Never named: say where it came from instead
+            logmsg(LOG_INFO, EV_LEAVE, "Removing unnamed client on fd %d from %s", p->fd, inet_ntoa(p->ipaddr));
+        }
+        STAT(closed, 1);
+        if (use_uring) {
+            // Ends the receive and any send still in flight; closing
+            // alone would not, as the ring holds its own reference
+            shutdown(p->fd, SHUT_RDWR);
+        } else {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+        }
+        close(p->fd);
+        STAT(syscalls, 2);
+        ip_release(p->ip);
+        profile_release(p);
+        removeclient(top, p->fd);
+    }
+}
+
+#ifdef HAVE_URING
+/* The io_uring backend. Each shard gets its own ring, set up by the
+ * shard's thread, and keeps one multishot request armed for each
+ * source of events: accept on the listening socket, poll on the
+ * eventfd and stats socket, and a receive per client that picks its
+ * buffers from a ring of UBUF_COUNT provided buffers. Sends are
+ * queued as the pass runs and all go to the kernel in the same
+ * io_uring_enter() that waits for the next completions, so a busy
+ * loop pass costs one system call however many clients it touched.
+ *
+ * Each request carries a pointer, a struct client or NULL, with the
+ * kind of request in the low bits.
+ */
+enum { UD_ACCEPT, UD_INBOX, UD_STATS, UD_CANCEL, UD_RECV, UD_SEND };
+# define UD_KIND 7
+
+/* A send in flight. The kernel reads msg and iov until it completes. */
+struct sendreq {
+    struct sendreq *next;
+    struct msghdr msg;
+    struct iovec iov[OUT_IOV];
+};
+
+static __thread struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local;                           // tail including unsubmitted entries
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *br;                // provided receive buffers
+    char *bufs;
+    unsigned short br_tail;
+    struct sendreq *free_sends;                  // recycled send requests
+} ring;
+
+static int uring_enter(unsigned wait, int timeout_ms) {
+    unsigned submit = ring.sq_local - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    struct __kernel_timespec ts = { timeout_ms / 1000, timeout_ms % 1000 * 1000000LL };
+    struct io_uring_getevents_arg arg = { .ts = (uintptr_t)&ts };
+
+    __atomic_store_n(ring.sq_tail, ring.sq_local, __ATOMIC_RELEASE);
+    STAT(syscalls, 1);
+    return syscall(__NR_io_uring_enter, ring.fd, submit, wait,
+                   IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0), &arg, sizeof(arg));
+}
+
+/* A cleared submission queue entry for a request of the given kind.
+ * It is submitted with the next io_uring_enter().
+ */
+static struct io_uring_sqe *uring_sqe(int kind, struct client *p) {
+    if (ring.sq_local - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.entries) {
+        uring_enter(0, 0);
+    }
+    struct io_uring_sqe *sqe = &ring.sqes[ring.sq_local++ & *ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uintptr_t)p | kind;
+    return sqe;
+}
+
+static void uring_buf_recycle(int bid) {
+    struct io_uring_buf *b = &ring.br->bufs[ring.br_tail & (UBUF_COUNT - 1)];
+
+    b->addr = (uintptr_t)(ring.bufs + (size_t)bid * UBUF_SIZE);
+    b->len = UBUF_SIZE;
+    b->bid = bid;
+    __atomic_store_n(&ring.br->tail, ++ring.br_tail, __ATOMIC_RELEASE);
+}
+
+/* Create the shard's ring and register its receive buffers. Multishot
+ * receive came in the same kernel as provided buffer rings, so a
+ * kernel that accepts the buffers can run the whole backend.
+ * returns 0 on success, -1 with errno set if the caller should fall
+ * back to epoll
+ */
+static int uring_setup(void) {
+    struct io_uring_params prm;
+
+    memset(&prm, 0, sizeof(prm));
+    prm.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    prm.cq_entries = URING_ENTRIES * 16;
+    ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &prm);
+    if (ring.fd == -1 && errno == EINVAL) {
+        // Kernels before 6.1 lack the task running hints
+        prm.flags = IORING_SETUP_CQSIZE;
+        ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &prm);
+    }
+    if (ring.fd == -1) {
+        return -1;
+    }
+    if (!(prm.features & IORING_FEAT_SINGLE_MMAP) || !(prm.features & IORING_FEAT_EXT_ARG)) {
+        close(ring.fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_size = prm.sq_off.array + prm.sq_entries * sizeof(unsigned);
+    size_t cq_size = prm.cq_off.cqes + prm.cq_entries * sizeof(struct io_uring_cqe);
+    size_t size = sq_size > cq_size ? sq_size : cq_size;
+    size_t sqes_size = prm.sq_entries * sizeof(struct io_uring_sqe);
+    size_t br_size = UBUF_COUNT * sizeof(struct io_uring_buf);
+    char *rings = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    void *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    void *br = mmap(NULL, br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring.bufs = malloc((size_t)UBUF_COUNT * UBUF_SIZE);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)br;
+    reg.ring_entries = UBUF_COUNT;
+    reg.bgid = 0;
+    if (rings == MAP_FAILED || sqes == MAP_FAILED || br == MAP_FAILED || !ring.bufs
+        || syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        int err = errno;
+        if (rings != MAP_FAILED) {
+            munmap(rings, size);
+        }
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        if (br != MAP_FAILED) {
+            munmap(br, br_size);
+        }
+        free(ring.bufs);
+        close(ring.fd);
+        errno = err;
+        return -1;
+    }
+
+    ring.entries = prm.sq_entries;
+    ring.sq_head = (unsigned *)(rings + prm.sq_off.head);
+    ring.sq_tail = (unsigned *)(rings + prm.sq_off.tail);
+    ring.sq_mask = (unsigned *)(rings + prm.sq_off.ring_mask);
+    ring.sq_local = *ring.sq_tail;
+    ring.sqes = sqes;
+    ring.cq_head = (unsigned *)(rings + prm.cq_off.head);
+    ring.cq_tail = (unsigned *)(rings + prm.cq_off.tail);
+    ring.cq_mask = (unsigned *)(rings + prm.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(rings + prm.cq_off.cqes);
+
+    // Submission queue slot i always holds entry i
+    unsigned *array = (unsigned *)(rings + prm.sq_off.array);
+    for (unsigned i = 0; i < prm.sq_entries; i++) {
+        array[i] = i;
+    }
+
+    ring.br = br;
+    ring.br_tail = 0;
+    for (int i = 0; i < UBUF_COUNT; i++) {
+        uring_buf_recycle(i);
+    }
+    return 0;
+}
+
+static void uring_accept(int listenfd) {
+    struct io_uring_sqe *sqe = uring_sqe(UD_ACCEPT, NULL);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+}
+
+static void uring_poll(int fd, int kind) {
+    struct io_uring_sqe *sqe = uring_sqe(kind, NULL);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+/* Arm the multishot receive that delivers all of p's input. */
+static void uring_recv(struct client *p) {
+    struct io_uring_sqe *sqe = uring_sqe(UD_RECV, p);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = p->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    p->inflight++;
+}
+
+static void uring_cancel(struct client *p) {
+    struct io_uring_sqe *sqe = uring_sqe(UD_CANCEL, NULL);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t)p | UD_RECV;
+}
+
+/* Send the front of p's output queue, unless a send is already in
+ * flight; its completion sends whatever was queued in the meantime.
+ * The segments stay queued, and so alive, until the kernel is done.
+ */
+static void uring_send(struct client *p) {
+    if (p->sendreq != NULL || p->out_head == NULL || p->dead) {
+        return;
+    }
+
+    struct sendreq *r = ring.free_sends;
+    if (r != NULL) {
+        ring.free_sends = r->next;
+    } else if ((r = malloc(sizeof(struct sendreq))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    int n = 0;
+    size_t off = p->out_off;
+    for (struct outseg *seg = p->out_head; seg != NULL && n < OUT_IOV; seg = seg->next, n++) {
+        r->iov[n].iov_base = seg->m->data + off;
+        r->iov[n].iov_len = seg->m->len - off;
+        off = 0;
+    }
+    memset(&r->msg, 0, sizeof(r->msg));
+    r->msg.msg_iov = r->iov;
+    r->msg.msg_iovlen = n;
+
+    struct io_uring_sqe *sqe = uring_sqe(UD_SEND, p);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = p->fd;
+    sqe->addr = (uintptr_t)&r->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    p->sendreq = r;
+    p->inflight++;
+}
+
+static void uring_send_done(struct client *p, int res) {
+    struct sendreq *r = p->sendreq;
+    size_t want = 0;
+
+    for (size_t i = 0; i < r->msg.msg_iovlen; i++) {
+        want += r->iov[i].iov_len;
+    }
+    r->next = ring.free_sends;
+    ring.free_sends = r;
+    p->sendreq = NULL;
+    if (--p->inflight == 0 && p->zombie) {
+        client_destroy(p);
+        return;
+    }
+    if (p->dead) {
+        return;
+    }
+    if (res < 0) {
+        kill_client(p);
+        return;
+    }
+
+    // A short send means the socket buffer is full; the kernel waits
+    // for room before completing the next one
+    out_advance(p, res);
+    if (p->out_head != NULL) {
+        p->out_blocked = (size_t)res < want;
+        uring_send(p);
+    }
+}
+
+/* Feed received bytes to p's line buffer, a buffer's worth at a time. */
+static void take_input(struct client *p, struct client *top, const char *data, size_t len) {
+    rbuf_open(p);
+    while (len > 0 && !p->dead) {
+        size_t n = RBUF_SIZE - p->rlen;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(p->rbuf + p->rlen, data, n);
+        p->rlen += n;
+        data += n;
+        len -= n;
+        frame_lines(p, top);
+    }
+    rbuf_close(p);
+}
+
+/* Finish moving p to another shard now that its receive is gone, or
+ * put it back in the queue if it found something to do meanwhile.
+ */
+static void uring_migrate(struct client *p, struct client *top) {
+    struct shard *other = p->migrate_to;
+
+    p->migrate_to = NULL;
+    if (p->dead) {
+        return;
+    }
+    if (p->inflight == 0 && p->out_head == NULL && !p->in_game
+        && handoff_client(top, p, other) == 0) {
+        return;
+    }
+    if (!p->in_game) {
+        enqueue_waiting(p);
+    }
+    uring_recv(p);
+}
+
+static void uring_recv_done(struct client *p, struct client *top, struct io_uring_cqe *cqe) {
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !p->dead) {
+            uint64_t t = now_ns();
+            take_input(p, top, ring.bufs + (size_t)bid * UBUF_SIZE, cqe->res);
+            hist_add(&self->stats.handle_ns, now_ns() - t);
+        }
+        uring_buf_recycle(bid);
+    }
+    if (cqe->flags & IORING_CQE_F_MORE) {
+        return;
+    }
+
+    // The receive has ended
+    if (--p->inflight == 0 && p->zombie) {
+        client_destroy(p);
+    } else if (p->migrate_to != NULL) {
+        uring_migrate(p, top);
+    } else if (p->dead) {
+        return;
+    } else if (cqe->res > 0 || cqe->res == -ENOBUFS) {
+        // Stopped early, by a full completion queue or no free buffers
+        uring_recv(p);
+    } else {
+        kill_client(p);
+    }
+}
+
+static void uring_complete(struct client *head, struct io_uring_cqe *cqe, int listenfd, int statsfd) {
+    struct client *p = (struct client *)(uintptr_t)(cqe->user_data & ~(uint64_t)UD_KIND);
+    int more = cqe->flags & IORING_CQE_F_MORE;
+
+    switch (cqe->user_data & UD_KIND) {
+    case UD_ACCEPT:
+        if (cqe->res < 0) {
+            // The request has ended; it is armed again below, or by
+            // uring_loop() once accept_retry is due
+            accept_failed(listenfd, -cqe->res);
+        } else {
+            struct sockaddr_in q;
+            socklen_t len = sizeof(q);
+            if (getpeername(cqe->res, (struct sockaddr *)&q, &len) == -1) {
+                q.sin_addr.s_addr = INADDR_ANY;
+            }
+            STAT(syscalls, 1);
+            accept_client(head, cqe->res, q.sin_addr);
+        }
+        if (more) {
+            accept_retry = 0;   // still armed, nothing to retry
+        } else if (accept_retry == 0) {
+            uring_accept(listenfd);
+        }
+        break;
+    case UD_INBOX:
+        adopt_clients(head);
+        if (!more) {
+            uring_poll(self->evfd, UD_INBOX);
+        }
+        break;
+    case UD_STATS:
+        serve_stats(statsfd);
+        if (!more) {
+            uring_poll(statsfd, UD_STATS);
+        }
+        break;
+    case UD_RECV:
+        uring_recv_done(p, head, cqe);
+        break;
+    case UD_SEND:
+        uring_send_done(p, cqe->res);
+        break;
+    }
+}
+
+/* The io_uring counterpart of epoll_loop(): the game logic and the
+ * end of pass work are the same, only how bytes come and go differs.
+ */
+static void uring_loop(struct client *head, int listenfd, int statsfd) {
+    uring_accept(listenfd);
+    uring_poll(self->evfd, UD_INBOX);
+    if (statsfd != -1) {
+        uring_poll(statsfd, UD_STATS);
+    }
+
+    while (1) {
+        // Submit this pass's sends and wait for the next completions
+        int timeout = tick_wait();
+        if (uring_enter(1, timeout) == -1
+            && errno != ETIME && errno != EINTR) {
+            logmsg(LOG_ERROR, EV_ERROR, "io_uring_enter: %m");
+        }
+        uint64_t loop_start = now_ns();
+        unsigned cq_head = *ring.cq_head;
+        unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        tick_start(loop_start, cq_head != cq_tail);
+        if (cq_head == cq_tail && timeout == SECONDS * 1000) {
+            logmsg(LOG_INFO, EV_SERVER, "No response from clients in %d seconds", SECONDS);
+            continue;
+        }
+
+        run_timers(head);
+        if (accept_retry != 0 && loop_start >= accept_retry) {
+            accept_retry = 0;
+            uring_accept(listenfd);
+        }
+
+        for (; cq_head != cq_tail; cq_head++) {
+            uring_complete(head, &ring.cqes[cq_head & *ring.cq_mask], listenfd, statsfd);
+        }
+        __atomic_store_n(ring.cq_head, cq_head, __ATOMIC_RELEASE);
+
+        finish_pass(head);
+        hist_add(&self->stats.loop_ns, now_ns() - loop_start);
+        if (atomic_load(&upgrade_pending)) {
+            upgrade_shard(head, listenfd, statsfd);
+        }
+    }
+}
+#endif
+
+/* Timers live on a hierarchical wheel owned by the shard: WHEEL_LEVELS
+ * rings of WHEEL_SLOTS lists, where one slot of a level spans a whole
+ * turn of the level below. Arming drops a timer into the slot covering
+ * its expiry and cancelling unlinks it, both O(1). Each time a level
+ * wraps, the next slot of the level above is cascaded down into it.
+ */
+static void wheel_insert(struct timer *t) {
+    uint64_t span = (uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS);
+    uint64_t when = t->expires > wheel_now ? t->expires : wheel_now;
+    int level = 0;
+
+    if (when - wheel_now >= span) {
+        when = t->expires = wheel_now + span - 1;
+    }
+    while (when - wheel_now >= (uint64_t)1 << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+
+    struct timer **slot = &wheel[level][(when >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    t->next = *slot;
+    if (t->next != NULL) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = slot;
+    *slot = t;
+}
+
+/* Arm t to fire ticks from now, replacing any earlier deadline. */
+static void timer_arm(struct timer *t, uint64_t ticks) {
+    timer_cancel(t);
+    t->expires = wheel_now + (ticks > 0 ? ticks : 1);
+    wheel_insert(t);
+    timers_armed++;
+}
+
+static void timer_cancel(struct timer *t) {
+    if (t->pprev == NULL) {
+        return;
+    }
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    t->pprev = NULL;
+    timers_armed--;
+}
+
+/* p's timer went off: drop it if it never gave a name or sat silent in
+ * the lobby for too long, or end the turn it is taking too long over.
+ */
+static void client_timeout(struct client *p, struct client *top) {
+    enum timeout what = p->timeout;
+
+    p->timeout = TO_NONE;
+    if (p->dead) {
+        return;
+    }
+
+    if (what == TO_NAME) {
+        logmsg(LOG_INFO, EV_TIMEOUT, "Dropping client on fd %d, no name given", p->fd);
+        STAT(timeouts_name, 1);
+        kill_client(p);
+    } else if (what == TO_IDLE) {
+        logmsg(LOG_INFO, EV_TIMEOUT, "Dropping idle client %s", p->name);
+        STAT(timeouts_idle, 1);
+        kill_client(p);
+    } else if (what == TO_TURN && turn_autoattack) {
+        char attack[] = "a";
+        STAT(timeouts_turn, 1);
+        logmsg(LOG_DEBUG, EV_TIMEOUT, "%s ran out of time, attacking for them", p->name);
+        p->speaking = 0;
+        processline(p, top, attack);
+    } else if (what == TO_TURN) {
+        struct client *opponent = p->seat->opponent;
+        STAT(timeouts_turn, 1);
+        logmsg(LOG_INFO, EV_TIMEOUT, "%s ran out of time against %s", p->name, opponent->name);
+        send_screen(p, T_TIMED_OUT, 0, 0, NULL);
+        send_screen(opponent, T_OPP_TIMED_OUT, 0, 0, NULL);
+        end_match(&top, opponent, p);
+    }
+}
+
+/* How long a loop pass may sleep: a tick while timers are pending or
+ * unmatched players wait for their rating windows to widen.
+ */
+static int loop_timeout(void) {
+    return timers_armed || wait_head != wait_tail || accept_retry != 0 ? TICK_MS : SECONDS * 1000;
+}
+
+/* Advance the wheel to the current time, firing everything now due. */
+static void run_timers(struct client *top) {
+    uint64_t now = now_ns() / 1000000 / TICK_MS;
+
+    if (timers_armed == 0) {
+        wheel_now = now + 1;
+        return;
+    }
+
+    for (; wheel_now <= now; wheel_now++) {
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if ((wheel_now >> (WHEEL_BITS * (level - 1))) & (WHEEL_SLOTS - 1)) {
+                break;
+            }
+            struct timer **slot = &wheel[level][(wheel_now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+            struct timer *t = *slot;
+            *slot = NULL;
+            while (t != NULL) {
+                struct timer *next = t->next;
+                wheel_insert(t);
+                t = next;
+            }
+        }
+
+        // Detach the due list first: a callback may cancel or re-arm
+        // any timer, including ones still waiting on this list
+        struct timer *due = wheel[0][wheel_now & (WHEEL_SLOTS - 1)];
+        wheel[0][wheel_now & (WHEEL_SLOTS - 1)] = NULL;
+        if (due != NULL) {
+            due->pprev = &due;
+        }
+        while (due != NULL) {
+            struct timer *t = due;
+            timer_cancel(t);
+            client_timeout((struct client *)((char *)t - offsetof(struct client, timer)), top);
+        }
+    }
+}
+
+/* Point p's timer at whatever p should be doing next: giving a name,
+ * making a move, or anything at all while in the lobby. A turn keeps
+ * its first deadline however much the player chats or mutes.
+ */
+static void update_timeout(struct client *p) {
+    enum timeout want = TO_NONE;
+    int secs = 0;
+
+    if (!p->name_set) {
+        want = TO_NAME;
+        secs = name_timeout;
+    } else if (!p->in_game) {
+        want = TO_IDLE;
+        secs = idle_timeout;
+    } else if (p->seat->fight.is_turn) {
+        want = TO_TURN;
+        secs = turn_timeout;
+    }
+    if (want == p->timeout && want != TO_IDLE) {
+        return;
+    }
+
+    p->timeout = want;
+    if (secs > 0) {
+        timer_arm(&p->timer, (uint64_t)secs * 1000 / TICK_MS);
+    } else {
+        timer_cancel(&p->timer);
+    }
+}
+
+/* Announce subject's header screen to every other client. The text and
+ * binary forms are each rendered once, on first use, and every
+ * recipient's queue only takes a reference.
+ */
+static void broadcast(struct client *top, struct client *subject, enum tplid header) {
+    struct client *p;
+    struct msgbuf *text = NULL, *frame = NULL;
+    // Skip the dummy head node by starting with top->next
+    for (p = top->next; p; p = p->next) {
+        if (p == subject) {
+            continue;
+        }
+        if (p->binary) {
+            if (frame == NULL) {
+                frame = render_frame(subject, header, 0, 0, NULL);
+            }
+            queue_msgbuf(p, frame);
+        } else {
+            if (text == NULL) {
+                text = render_text(subject, header, 0, 0, NULL);
+            }
+            queue_msgbuf(p, text);
+        }
+    }
+    if (text != NULL) {
+        msgbuf_put(text);
+    }
+    if (frame != NULL) {
+        msgbuf_put(frame);
+    }
+}
+/* Handle a lobby client's watch command: stop watching whatever p
+ * watches, then start on the match the player called name is in. Only
+ * matches on p's own shard can be found.
+ */
+static void watch_command(struct client *p, const char *name) {
+    struct client *x;
+
+    if (*name == '\0') {
+        unwatch(p);
+        send_screen(p, T_UNWATCHED, 0, 0, NULL);
+        return;
+    }
+
+    x = find_player(name);
+    if (x == NULL || !x->in_game) {
+        send_screen(p, T_NO_MATCH, 0, 0, name);
+        return;
+    }
+
+    unwatch(p);
+    struct match *m = x->seat->match;
+    struct seat *s = seat_attach(p);
+    s->watching = m;
+    s->watch_prev = NULL;
+    s->watch_next = m->watchers;
+    if (m->watchers != NULL) {
+        m->watchers->seat->watch_prev = p;
+    }
+    m->watchers = p;
+    STAT(spectators, 1);
+
+    // The opening screen shows the match from the watched player's side
+    send_about(p, x, T_WATCHING, 0, NULL);
+}
+
+/* Handle a lobby client's challenge: if name has already challenged
+ * p the two are matched at once, otherwise name is told and can answer
+ * in kind. A new challenge replaces the last one. Only players on p's
+ * own shard can be challenged.
+ */
+static void challenge_command(struct client *p, const char *name) {
+    struct client *x;
+
+    if (*name == '\0') {
+        if (p->seat != NULL) {
+            p->seat->challenged[0] = '\0';
+            seat_release(p);
+        }
+        send_screen(p, T_UNCHALLENGED, 0, 0, NULL);
+        return;
+    }
+
+    x = find_player(name);
+    if (x == NULL || x == p) {
+        send_screen(p, T_NOT_HERE, 0, 0, name);
+        return;
+    }
+    if (x->in_game) {
+        send_screen(p, T_BUSY, 0, 0, x->name);
+        return;
+    }
+
+    if (x->seat != NULL && !strcmp(x->seat->challenged, p->name)) {
+        logmsg(LOG_INFO, EV_MATCH_START, "%s accepted %s's challenge.", p->name, x->name);
+        start_battle(x, p);
+        return;
+    }
+
+    struct seat *s = seat_attach(p);
+    memcpy(s->challenged, x->name, sizeof(s->challenged));
+    send_screen(p, T_CHALLENGE, 0, 0, x->name);
+    send_about(x, p, T_CHALLENGED, 0, NULL);
+}
+
+/* Handle "t name text", from the lobby or a match: pass text to name
+ * alone, wherever it is, unless it has muted chat or speaks the binary
+ * protocol. Whispers count against the sender's chat budget. A name
+ * ends at the first space.
+ */
+static void whisper_command(struct client *p, char *args) {
+    char *text = strchr(args, ' ');
+    struct client *x;
+
+    if (text == NULL) {
+        return;
+    }
+    *text++ = '\0';
+
+    x = find_player(args);
+    if (x == NULL) {
+        send_screen(p, T_NOT_HERE, 0, 0, args);
+        return;
+    }
+    if (x == p) {
+        send_screen(p, T_WHISPER_SELF, 0, 0, NULL);
+        return;
+    }
+    if (x->muted) {
+        send_screen(p, T_WHISPER_MUTED, 0, 0, x->name);
+        return;
+    }
+    if (x->binary) {
+        // The binary protocol has no frame for a whisper
+        send_screen(p, T_WHISPER_BINARY, 0, 0, x->name);
+        return;
+    }
+    if (!ip_take(p->ip, 1)) {
+        STAT(chat_limited, 1);
+        send_screen(p, T_SLOW_DOWN, 0, 0, NULL);
+        return;
+    }
+
+    char speech[SPEECH_MAX];
+    strncpy(speech, text, sizeof(speech) - 1);
+    speech[sizeof(speech) - 1] = '\0';
+    struct msgbuf *msg = render_text(p, T_WHISPER, 0, 0, speech);
+    queue_msgbuf(x, msg);
+    msgbuf_put(msg);
+    send_screen(p, T_WHISPERED, 0, 0, x->name);
+}
+
+static void unwatch(struct client *p) {
+    struct seat *s = p->seat;
+
+    if (s == NULL || s->watching == NULL) {
+        return;
+    }
+    if (s->watch_prev != NULL) {
+        s->watch_prev->seat->watch_next = s->watch_next;
+    } else {
+        s->watching->watchers = s->watch_next;
+    }
+    if (s->watch_next != NULL) {
+        s->watch_next->seat->watch_prev = s->watch_prev;
+    }
+    s->watching = NULL;
+    STAT(spectators, -1);
+    seat_release(p);
+}
+
+/* Show subject's header screen to everyone watching subject's match.
+ * The text and binary forms are each rendered once, on first use, and
+ * every spectator's queue takes a reference.
+ * A spectator whose socket has stopped taking output and whose backlog
+ * passes SPECTATOR_HIGHWATER stops watching rather than holding the
+ * match's output in memory; the players never wait for spectators.
+ */
+static void spectate(struct client *subject, enum tplid header, int dmg, const char *text) {
+    struct match *m = subject->seat != NULL ? subject->seat->match : NULL;
+
+    if (m == NULL || m->watchers == NULL) {
+        return;
+    }
+
+    struct msgbuf *text_msg = NULL, *frame = NULL;
+    struct client *w = m->watchers, *next;
+    for (; w != NULL; w = next) {
+        next = w->seat->watch_next;
+        if (w->out_blocked && w->out_bytes > SPECTATOR_HIGHWATER) {
+            logmsg(LOG_DEBUG, EV_SLOW, "Spectator %s fell behind (%zu bytes queued)", w->name, w->out_bytes);
+            STAT(spectators_shed, 1);
+            unwatch(w);
+            continue;
+        }
+        if (w->binary) {
+            if (frame == NULL) {
+                frame = render_frame(subject, header, 0, dmg, text);
+            }
+            queue_msgbuf(w, frame);
+        } else {
+            if (text_msg == NULL) {
+                text_msg = render_text(subject, header, 0, dmg, text);
+            }
+            queue_msgbuf(w, text_msg);
+        }
+    }
+    if (text_msg != NULL) {
+        msgbuf_put(text_msg);
+    }
+    if (frame != NULL) {
+        msgbuf_put(frame);
+    }
+}
+
+/* Tell the spectators who won, send them back to the lobby and retire
+ * the match. Called while winner->opponent still names the loser.
+ */
+static void match_over(struct client *winner) {
+    struct match *m = winner->seat->match;
+
+    if (m == NULL) {
+        return;
+    }
+    spectate(winner, T_SEE_WON, 0, NULL);
+    while (m->watchers != NULL) {
+        unwatch(m->watchers);
+    }
+    winner->seat->match = NULL;
+    winner->seat->opponent->seat->match = NULL;
+    match_free(m);
+}
+
+/* Two clients may not be paired again while each one's most recent
+ * match was against the other.
+ */
+static int is_rematch(struct client *a, struct client *b) {
+    return a->seat->last_opponent == b && b->seat->last_opponent == a;
+}
+
+/* Index bucket for a rating; the end buckets also hold everything
+ * beyond them.
+ */
+static int rating_bucket(int rating) {
+    int b = (rating - RATING_START) / RATING_BUCKET + RATING_BUCKETS / 2;
+    if (rating < RATING_START && (RATING_START - rating) % RATING_BUCKET != 0) {
+        b--;    // round towards minus infinity
+    }
+    return b < 0 ? 0 : b >= RATING_BUCKETS ? RATING_BUCKETS - 1 : b;
+}
+
+/* Lowest rating bucket b can hold, bar the clamped bottom bucket. */
+static int bucket_floor(int b) {
+    return RATING_START + (b - RATING_BUCKETS / 2) * RATING_BUCKET;
+}
+
+/* The oldest client in bucket b that current may play, or NULL. Besides
+ * current itself each client has at most one excluded partner, so at
+ * most three entries are looked at.
+ */
+static struct client *bucket_pick(int b, struct client *current) {
+    for (struct client *x = buckets[b]; x != NULL; x = x->seat->bucket_next) {
+        if (x != current && !is_rematch(current, x)) {
+            return x;
+        }
+    }
+    return NULL;
+}
+
+/* Pair current, which must be waiting, with the waiting client closest
+ * to it in rating that it did not just play, and start their battle.
+ * The gap allowed starts at MATCH_WINDOW and widens the longer current
+ * has waited. Within one bucket the oldest client is taken. Buckets are
+ * visited outwards from current's own, skipping empty ones through
+ * bucket_mask, until no nearer partner can be in the next one, so a
+ * search costs at most RATING_BUCKETS steps whatever the queue length.
+ * returns the matched opponent, or NULL if nobody suitable is waiting
+ */
+static struct client *match_opponent(struct client *current, uint64_t now) {
+    uint64_t waited_ms = (now - current->seat->wait_since) / 1000000;
+    int window = MATCH_WINDOW + (int)(waited_ms * MATCH_WIDEN / 1000);
+    int home = rating_bucket(current->rating);
+    struct client *matched = bucket_pick(home, current), *x;
+    int best = matched != NULL ? abs(matched->rating - current->rating) : INT_MAX;
+
+    // Upwards: everyone in bucket b is at least bucket_floor(b) - rating away
+    uint64_t up = home + 1 < RATING_BUCKETS ? bucket_mask >> (home + 1) << (home + 1) : 0;
+    while (up != 0) {
+        int b = __builtin_ctzll(up);
+        int bound = bucket_floor(b) - current->rating;
+        if (bound >= best || bound > window) {
+            break;
+        }
+        up &= up - 1;
+        if ((x = bucket_pick(b, current)) != NULL && abs(x->rating - current->rating) < best) {
+            matched = x;
+            best = abs(x->rating - current->rating);
+        }
+    }
+
+    // Downwards: everyone in bucket b is at least rating - bucket_floor(b + 1) + 1 away
+    uint64_t down = bucket_mask & ((1ULL << home) - 1);
+    while (down != 0) {
+        int b = 63 - __builtin_clzll(down);
+        int bound = current->rating - bucket_floor(b + 1) + 1;
+        if (bound >= best || bound > window) {
+            break;
+        }
+        down &= ~(1ULL << b);
+        if ((x = bucket_pick(b, current)) != NULL && abs(x->rating - current->rating) < best) {
+            matched = x;
+            best = abs(x->rating - current->rating);
+        }
+    }
+
+    if (matched == NULL || best > window) {
+        return NULL;
+    }
+
+    hist_add(&self->stats.match_wait_ns, now - current->seat->wait_since);
+    hist_add(&self->stats.match_wait_ns, now - matched->seat->wait_since);
+    hist_add(&self->stats.match_gap, best);
+    start_battle(current, matched);
+
+    return matched;
+}
+
+/* Append p to the waiting queue and its rating bucket; the next
+ * matchmaking pass will try to pair it.
+ */
+static void enqueue_waiting(struct client *p) {
+    if (p->waiting) {
+        return;
+    }
+    struct seat *s = seat_attach(p);
+    p->waiting = 1;
+    s->wait_since = now_ns();
+    STAT(waiting, 1);
+    s->wait_next = NULL;
+    s->wait_prev = wait_tail;
+    if (wait_tail != NULL) {
+        wait_tail->seat->wait_next = p;
+    } else {
+        wait_head = p;
+    }
+    wait_tail = p;
+
+    int b = rating_bucket(p->rating);
+    s->bucket_next = NULL;
+    s->bucket_prev = bucket_tails[b];
+    if (bucket_tails[b] != NULL) {
+        bucket_tails[b]->seat->bucket_next = p;
+    } else {
+        buckets[b] = p;
+        bucket_mask |= 1ULL << b;
+    }
+    bucket_tails[b] = p;
+    queue_dirty = 1;
+}
+
+static void dequeue_waiting(struct client *p) {
+    struct seat *s = p->seat;
+
+    if (!p->waiting) {
+        return;
+    }
+    if (s->wait_prev != NULL) {
+        s->wait_prev->seat->wait_next = s->wait_next;
+    } else {
+        wait_head = s->wait_next;
+    }
+    if (s->wait_next != NULL) {
+        s->wait_next->seat->wait_prev = s->wait_prev;
+    } else {
+        wait_tail = s->wait_prev;
+    }
+
+    // The rating cannot change while waiting, so p is still in this bucket
+    int b = rating_bucket(p->rating);
+    if (s->bucket_prev != NULL) {
+        s->bucket_prev->seat->bucket_next = s->bucket_next;
+    } else {
+        buckets[b] = s->bucket_next;
+    }
+    if (s->bucket_next != NULL) {
+        s->bucket_next->seat->bucket_prev = s->bucket_prev;
+    } else {
+        bucket_tails[b] = s->bucket_prev;
+    }
+    if (buckets[b] == NULL) {
+        bucket_mask &= ~(1ULL << b);
+    }
+    p->waiting = 0;
+    STAT(waiting, -1);
+    seat_release(p);
 }
 void end_match(struct client **top, struct client *p1, struct client *p2) {
     if (!p1 || !p2) {
         return; // Check if either pointer is NULL
     }
 
+    match_over(p1);
+
     p1->in_game = 0;
     p2->in_game = 0;
-    p1->hitpoints = 30;
-    p2->hitpoints = 30;
-    p1->is_turn = 0;
-    p2->is_turn = 0;
-    p1->power_moves = rand() % 3 + 1;
-    p2->power_moves = rand() % 3 + 1;
-    p1->speak_count = 0;
-    p2->speak_count = 0;
-
-    // Update last_opponent for future matchmaking logic
-    p1->last_opponent = p2;
-    p2->last_opponent = p1;
+    fight_reset(&p1->seat->fight, &rng);
+    fight_reset(&p2->seat->fight, &rng);
+
+    // Update last_opponent for future matchmaking logic; the seats
+    // stay attached since both go straight back into the queue
+    p1->seat->last_opponent = p2;
+    p2->seat->last_opponent = p1;
 
     // Clear current opponent since the match has ended
-    p1->opponent = NULL;
-    p2->opponent = NULL;
+    p1->seat->opponent = NULL;
+    p2->seat->opponent = NULL;
 
-    printf("Match between %s and %s has ended.\n", p1->name, p2->name);
+    logmsg(LOG_INFO, EV_MATCH_END, "Match between %s and %s has ended.", p1->name, p2->name);
+    STAT(matches_ended, 1);
 
-    // Move the clients to the end of the list
+    // p1 is always the winner
+    profile_record(p1, p2);
+    send_board(p1);
+    send_board(p2);
+
+    // Move the clients to the end of the list and back into the queue
     move_client_end(top, p1);
     move_client_end(top, p2);
+    enqueue_waiting(p1);
+    enqueue_waiting(p2);
+    update_timeout(p1);
+    update_timeout(p2);
 }
 void move_client_end(struct client **top, struct client *move) {
-    if (*top == NULL || move == NULL) {
+    if (*top == NULL || move == NULL || move == *top) {
         return;
     }
 
-    if ((*top) == move) {
-        return; // If move is the first node, no need to move it.
+    // Already the last element, no need to move
+    if (move->next == NULL) {
+        return;
     }
 
-    struct client *current = *top;
-    struct client *prev = NULL;
+    // Unlink the node from its current position
+    move->prev->next = move->next;
+    move->next->prev = move->prev;
+
+    // Append the node at the end
+    move->prev = (*top)->prev;
+    (*top)->prev->next = move;
+    (*top)->prev = move;
+    move->next = NULL;
+}
+void start_battle(struct client *p1, struct client *p2) {
+    p1->in_game = 1;
+    STAT(matches_started, 1);
+    p2->in_game = 1;
+
+    // Playing keeps the seats that queueing attached
+    struct seat *s1 = seat_attach(p1), *s2 = seat_attach(p2);
+    dequeue_waiting(p1);
+    dequeue_waiting(p2);
+
+    // Set opponents; players cannot also be spectators
+    s1->opponent = p2;
+    s2->opponent = p1;
+    unwatch(p1);
+    unwatch(p2);
+    s1->challenged[0] = s2->challenged[0] = '\0';
+    s1->match = s2->match = match_alloc();
+    // Fresh hitpoints and a random first mover
+    fight_start(&s1->fight, &s2->fight, &rng);
+
+    update_timeout(p1);
+    update_timeout(p2);
+
+    // Each player sees the other's stats and either the menu or the wait line
+    send_screen(p1, T_ENGAGE, SCR_STATUS | (s1->fight.is_turn ? SCR_MENU : SCR_WAIT), 0, NULL);
+    send_screen(p2, T_ENGAGE, SCR_STATUS | (s2->fight.is_turn ? SCR_MENU : SCR_WAIT), 0, NULL);
+}
+
+/* SIGUSR2: ask every shard to stop at the end of its pass for a hot
+ * upgrade. Only the flag and the eventfd writes happen here.
+ */
+static void upgrade_signal(int sig) {
+    uint64_t one = 1;
+    (void)sig;
 
-    while (current != NULL && current != move) {
-        prev = current;
-        current = current->next;
+    atomic_store(&upgrade_pending, 1);
+    for (int i = 0; i < nshards; i++) {
+        if (write(shards[i].evfd, &one, sizeof(one)) == -1) {
+            // Already woken
+        }
     }
+}
 
-    // If not found or it's already the last element, no need to move
-    if (current == NULL || current->next == NULL) {
-        return;
+static void upbuf_add(struct upbuf *b, const void *data, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 65536;
+        while (cap < b->len + len) {
+            cap *= 2;
+        }
+        char *d = realloc(b->data, cap);
+        if (d == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        b->data = d;
+        b->cap = cap;
     }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
 
-    // Unlink the node from its current position
-    if (prev != NULL) {
-        prev->next = current->next;
+static void upbuf_add_fd(struct upbuf *b, int fd) {
+    if (b->nfds == b->fdcap) {
+        size_t cap = b->fdcap ? b->fdcap * 2 : 1024;
+        int *f = realloc(b->fds, cap * sizeof(*f));
+        if (f == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        b->fds = f;
+        b->fdcap = cap;
+    }
+    b->fds[b->nfds++] = fd;
+}
+
+/* Record index of q if it is one of this shard's live clients, or -1.
+ * last_opponent may point at a record that has since been freed.
+ */
+static int32_t upgrade_index(struct client *q, struct client **live, int n) {
+    if (q == NULL || q->index < 0 || q->index >= n || live[q->index] != q) {
+        return -1;
     }
+    return q->index;
+}
+
+/* Pack every client of this shard into self->up, leaving the shard as
+ * it is in case the upgrade fails.
+ */
+static void upgrade_pack(struct client *head, int listenfd, int statsfd) {
+    struct upbuf *b = &self->up;
+    struct upgrade_shard us;
+    struct client *p;
+    int n = 0, i = 0;
+    uint64_t now = now_ns();
 
-    // Find the last node
-    struct client *last = *top;
-    while (last->next != NULL) {
-        last = last->next;
+    b->len = 0;
+    b->nfds = 0;
+    for (p = head->next; p != NULL; p = p->next) {
+        n += !p->dead;
+    }
+    struct client **live = malloc((n ? n : 1) * sizeof(*live));
+    int32_t *target = malloc((n ? n : 1) * sizeof(*target));
+    if (live == NULL || target == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    // Clients already killed this pass are left behind
+    for (p = head->next; p != NULL; p = p->next) {
+        p->index = -1;
+        if (!p->dead) {
+            live[i] = p;
+            target[i] = -1;
+            p->index = i++;
+        }
+    }
+    // Spectators only know their match, and a match only its spectators
+    for (i = 0; i < n; i++) {
+        if (live[i]->in_game && live[i]->seat->match != NULL) {
+            for (p = live[i]->seat->match->watchers; p != NULL; p = p->seat->watch_next) {
+                if (p->index >= 0) {
+                    target[p->index] = i;
+                }
+            }
+        }
     }
 
-    // Append the node at the end
-    last->next = move;
-    move->next = NULL;
+    us.nclients = n;
+    us.has_stats = statsfd != -1;
+    upbuf_add(b, &us, sizeof(us));
+    upbuf_add_fd(b, listenfd);
+    if (statsfd != -1) {
+        upbuf_add_fd(b, statsfd);
+    }
+
+    for (i = 0; i < n; i++) {
+        struct upgrade_rec r;
+        p = live[i];
+        memset(&r, 0, sizeof(r));
+        memcpy(r.name, p->name, sizeof(r.name));
+        r.ipaddr = p->ipaddr.s_addr;
+        r.opponent = p->in_game ? upgrade_index(p->seat->opponent, live, n) : -1;
+        r.last_opponent = p->seat != NULL ? upgrade_index(p->seat->last_opponent, live, n) : -1;
+        r.watching = target[i];
+        if (p->seat != NULL) {
+            memcpy(r.challenged, p->seat->challenged, sizeof(r.challenged));
+        }
+        r.name_set = p->name_set;
+        r.in_game = p->in_game;
+        r.speaking = p->speaking;
+        r.binary = p->binary;
+        r.waiting = p->waiting;
+        if (p->seat != NULL) {
+            r.hitpoints = p->seat->fight.hitpoints;
+            r.power_moves = p->seat->fight.power_moves;
+            r.is_turn = p->seat->fight.is_turn;
+            r.speak_count = p->seat->fight.speak_count;
+        }
+        r.muted = p->muted;
+        r.rlen = p->rlen;
+        r.rskip = p->rskip;
+        r.out_len = p->out_bytes - p->out_off;
+        r.waited_ms = p->waiting ? (now - p->seat->wait_since) / 1000000 : 0;
+        upbuf_add(b, &r, sizeof(r));
+        if (p->rlen > 0) {
+            upbuf_add(b, p->rbuf, p->rlen);
+        }
+        size_t off = p->out_off;
+        for (struct outseg *seg = p->out_head; seg != NULL; seg = seg->next) {
+            upbuf_add(b, seg->m->data + off, seg->m->len - off);
+            off = 0;
+        }
+        upbuf_add_fd(b, p->fd);
+    }
+    free(live);
+    free(target);
 }
-void start_battle(struct client *p1, struct client *p2) {
-    p1->hitpoints = 30;
-    p2->hitpoints = 30;
-    p1->power_moves = rand() % 3 + 1;
-    p2->power_moves = rand() % 3 + 1;
-    p1->in_game = 1;
-    p2->in_game = 1;
-    
-    // Set opponents
-    p1->opponent = p2;
-    p2->opponent = p1;
-    p1->speak_count = 0;
-    p2->speak_count = 0;
-    // Randomly decide who goes first
-    if (rand() % 2 == 0) {
-        p1->is_turn = 1;
-        p2->is_turn = 0;
-    } else {
-        p1->is_turn = 0;
-        p2->is_turn = 1;
-    }
-
-    char turn_msg[500];
-    char wait_msg[500];
-
-    // Decide who goes first and send the appropriate messages
-    if (p1->is_turn) {
-        snprintf(turn_msg, sizeof(turn_msg),
-         "\nYou engage %s!\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\n\nIt's your turn:\n(a)ttack\n(p)owermove\n(s)peak something\n(m)ute chat\n",
-         p2->name, p1->hitpoints, p1->power_moves,p2->name, p2->hitpoints);
-        snprintf(wait_msg, sizeof(wait_msg),
-         "\nYou engage %s!\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\nWaiting for %s to strike...\r\n",
-         p1->name, p2->hitpoints, p2->power_moves, p1->name, p1->hitpoints, p1->name);
-        send(p1->fd, turn_msg, strlen(turn_msg), 0);
-        send(p2->fd, wait_msg, strlen(wait_msg), 0);
+
+static int read_full(int fd, void *buf, size_t len) {
+    char *s = buf;
+
+    while (len > 0) {
+        ssize_t r = read(fd, s, len);
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        s += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* Pass descriptors over the upgrade channel, UPGRADE_FDS to a message,
+ * each message carrying one byte so none are merged.
+ */
+static int send_fds(int chan, const int *fds, size_t n) {
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(UPGRADE_FDS * sizeof(int))];
+    } ctl;
+
+    for (size_t off = 0; off < n; off += UPGRADE_FDS) {
+        size_t k = n - off < UPGRADE_FDS ? n - off : UPGRADE_FDS;
+        char byte = 0;
+        struct iovec iov = { &byte, 1 };
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = CMSG_SPACE(k * sizeof(int));
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(k * sizeof(int));
+        memcpy(CMSG_DATA(c), fds + off, k * sizeof(int));
+        if (sendmsg(chan, &msg, MSG_NOSIGNAL) != 1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int recv_fds(int chan, int *fds, size_t n) {
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(UPGRADE_FDS * sizeof(int))];
+    } ctl;
+
+    for (size_t off = 0; off < n; ) {
+        char byte;
+        struct iovec iov = { &byte, 1 };
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        if (recvmsg(chan, &msg, 0) != 1) {
+            return -1;
+        }
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        if (c == NULL || c->cmsg_type != SCM_RIGHTS || (msg.msg_flags & MSG_CTRUNC)) {
+            return -1;
+        }
+        size_t k = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (k > n - off) {
+            return -1;
+        }
+        memcpy(fds + off, CMSG_DATA(c), k * sizeof(int));
+        off += k;
+    }
+    return 0;
+}
+
+/* Run by one shard once all have packed their clients: start the new
+ * binary with the same arguments, stream everything to it and wait for
+ * it to confirm it has taken over.
+ * returns 0 if it has, -1 if this process should carry on
+ */
+static int upgrade_exec(void) {
+    struct upgrade_header h;
+    struct snap_rec *profiles = NULL;
+    size_t nprofiles = 0;
+    int sv[2];
+
+    // With -P the new process loads the profiles from disk, so the
+    // results not yet written go there now and the writer is held off;
+    // otherwise they travel with the clients
+    if (profile_path != NULL) {
+        pthread_mutex_lock(&profile_io_lock);
+        pthread_mutex_lock(&profile_lock);
+        int failed = nresults > 0
+            && (write_all(profile_log, results, nresults * sizeof(*results)) == -1 || fdatasync(profile_log) == -1);
+        results_logged += nresults;
+        nresults = 0;
+        pthread_mutex_unlock(&profile_lock);
+        if (failed) {
+            logmsg(LOG_ERROR, EV_ERROR, "profile log: %m");
+        }
     } else {
-        snprintf(turn_msg, sizeof(turn_msg),
-         "\nYou engage %s!\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\n\nIt's your turn:\n(a)ttack\n(p)owermove\n(s)peak something\n(m)ute chat\n",
-         p1->name, p2->hitpoints, p2->power_moves,p1->name, p1->hitpoints);
-        snprintf(wait_msg, sizeof(wait_msg),
-         "\nYou engage %s!\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\nWaiting for %s to strike...\r\n",
-         p2->name, p1->hitpoints, p1->power_moves, p2->name, p2->hitpoints, p2->name);
-        send(p1->fd, wait_msg, strlen(wait_msg), 0);
-        send(p2->fd, turn_msg, strlen(turn_msg), 0);
+        pthread_mutex_lock(&profile_lock);
+        profiles = snap_collect(&nprofiles);
+        pthread_mutex_unlock(&profile_lock);
+        if (profiles == NULL) {
+            return -1;
+        }
+    }
+
+    memset(&h, 0, sizeof(h));
+    h.magic = UPGRADE_MAGIC;
+    h.nshards = nshards;
+    h.nprofiles = nprofiles;
+    for (int i = 0; i < nshards; i++) {
+        h.nfds += shards[i].up.nfds;
+        h.len += shards[i].up.len;
+    }
+
+    // The environment is built before forking; the child may only make
+    // async-signal-safe calls until it execs
+    extern char **environ;
+    size_t nenv = 0;
+    while (environ[nenv] != NULL) {
+        nenv++;
+    }
+    char **envp = malloc((nenv + 2) * sizeof(*envp));
+    if (envp == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        logmsg(LOG_ERROR, EV_ERROR, "hot upgrade: %m");
+        free(envp);
+        free(profiles);
+        return -1;
+    }
+    size_t e = 0;
+    for (size_t i = 0; i < nenv; i++) {
+        if (strncmp(environ[i], UPGRADE_ENV "=", sizeof(UPGRADE_ENV)) != 0) {
+            envp[e++] = environ[i];
+        }
+    }
+    static char upgrade_var[] = UPGRADE_ENV "=3";
+    envp[e++] = upgrade_var;
+    envp[e] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (dup2(sv[1], UPGRADE_FD) == -1) {
+            _exit(127);
+        }
+        close_range(UPGRADE_FD + 1, ~0U, 0);
+        execvpe(saved_argv[0], saved_argv, envp);
+        _exit(127);
+    }
+    close(sv[1]);
+    free(envp);
+    if (pid == -1) {
+        logmsg(LOG_ERROR, EV_ERROR, "hot upgrade: fork: %m");
+        close(sv[0]);
+        free(profiles);
+        return -1;
+    }
+
+    struct timeval tv = { UPGRADE_TIMEOUT_MS / 1000, UPGRADE_TIMEOUT_MS % 1000 * 1000 };
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int ok = write_all(sv[0], &h, sizeof(h)) == 0;
+    for (int i = 0; ok && i < nshards; i++) {
+        ok = send_fds(sv[0], shards[i].up.fds, shards[i].up.nfds) == 0;
+    }
+    for (int i = 0; ok && i < nshards; i++) {
+        ok = write_all(sv[0], shards[i].up.data, shards[i].up.len) == 0;
+    }
+    if (ok && nprofiles > 0) {
+        ok = write_all(sv[0], profiles, nprofiles * sizeof(*profiles)) == 0;
+    }
+    free(profiles);
+
+    // The new process answers once it holds every descriptor
+    struct pollfd pfd = { sv[0], POLLIN, 0 };
+    char ack = 0;
+    if (ok) {
+        ok = poll(&pfd, 1, UPGRADE_TIMEOUT_MS) == 1 && read(sv[0], &ack, 1) == 1 && ack == 'k';
+    }
+    close(sv[0]);
+    if (!ok) {
+        logmsg(LOG_ERROR, EV_ERROR, "hot upgrade: new process %d did not take over, carrying on", (int)pid);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        if (profile_path != NULL) {
+            pthread_mutex_unlock(&profile_io_lock);
+        }
+        return -1;
+    }
+    logmsg(LOG_INFO, EV_SERVER, "Hot upgrade: handed %u descriptors to process %d", h.nfds, (int)pid);
+    return 0;
+}
+
+/* Take part in a hot upgrade at the end of a loop pass. Every shard
+ * stops here; once all have packed their clients one of them hands
+ * everything to the new process. If that works this process exits,
+ * and if not every shard carries on as before.
+ */
+static void upgrade_shard(struct client *head, int listenfd, int statsfd) {
+    if (want_uring) {
+        if (atomic_exchange(&upgrade_pending, 0)) {
+            logmsg(LOG_WARN, EV_SERVER, "Hot upgrade is not supported with -U");
+        }
+        return;
+    }
+
+    uint64_t start = now_ns();
+    pthread_barrier_wait(&upgrade_barrier);
+
+    // No shard hands off any more; take in whatever is still in flight
+    adopt_clients(head);
+    upgrade_pack(head, listenfd, statsfd);
+
+    if (pthread_barrier_wait(&upgrade_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+        upgrade_done = upgrade_exec() == 0;
+        atomic_store(&upgrade_pending, 0);
+        if (upgrade_done) {
+            logmsg(LOG_INFO, EV_SERVER, "Hot upgrade done in %.1f ms", (now_ns() - start) / 1e6);
+        }
+    }
+    pthread_barrier_wait(&upgrade_barrier);
+
+    if (upgrade_done) {
+        // The new process owns every socket now; give the logger a
+        // moment to write out the last lines, then go
+        if (self->id == 0) {
+            struct timespec nap = { 0, 50 * 1000000 };
+            nanosleep(&nap, NULL);
+            exit(0);
+        }
+        while (1) {
+            pause();
+        }
+    }
+}
+
+/* In the new process, before any shard starts: read the old process's
+ * state and sockets from the upgrade channel, give each shard its part
+ * and confirm. Anything unusable exits without confirming, which leaves
+ * the old process running.
+ */
+static void upgrade_receive(int chan) {
+    struct upgrade_header h;
+    uint64_t start = now_ns();
+
+    if (read_full(chan, &h, sizeof(h)) == -1 || h.magic != UPGRADE_MAGIC || h.nshards != (uint32_t)nshards) {
+        fprintf(stderr, "hot upgrade: unusable state from the old process\n");
+        exit(1);
+    }
+    int *fds = malloc((h.nfds ? h.nfds : 1) * sizeof(*fds));
+    char *data = malloc(h.len ? h.len : 1);
+    if (fds == NULL || data == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if (recv_fds(chan, fds, h.nfds) == -1 || read_full(chan, data, h.len) == -1) {
+        fprintf(stderr, "hot upgrade: lost the old process\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < h.nprofiles; i++) {
+        struct snap_rec rec;
+        if (read_full(chan, &rec, sizeof(rec)) == -1) {
+            fprintf(stderr, "hot upgrade: lost the old process\n");
+            exit(1);
+        }
+        rec.name[sizeof(rec.name) - 1] = '\0';
+        profile_restore(&rec);
+    }
+
+    // Split the records and descriptors by shard
+    size_t off = 0, fd_off = 0, clients = 0;
+    for (int i = 0; i < nshards; i++) {
+        struct upgrade_shard us;
+        size_t begin = off;
+        if (h.len - off < sizeof(us)) {
+            fprintf(stderr, "hot upgrade: short shard record\n");
+            exit(1);
+        }
+        memcpy(&us, data + off, sizeof(us));
+        off += sizeof(us);
+        for (uint32_t c = 0; c < us.nclients; c++) {
+            struct upgrade_rec r;
+            if (h.len - off < sizeof(r)) {
+                fprintf(stderr, "hot upgrade: short client record\n");
+                exit(1);
+            }
+            memcpy(&r, data + off, sizeof(r));
+            if (r.rlen < 0 || r.rlen > RBUF_SIZE || h.len - off - sizeof(r) < (size_t)r.rlen + r.out_len) {
+                fprintf(stderr, "hot upgrade: bad client record\n");
+                exit(1);
+            }
+            off += sizeof(r) + r.rlen + r.out_len;
+        }
+        size_t nfds = 1 + us.has_stats + us.nclients;
+        if (h.nfds - fd_off < nfds) {
+            fprintf(stderr, "hot upgrade: descriptors missing\n");
+            exit(1);
+        }
+        shards[i].up.data = data + begin;
+        shards[i].up.len = off - begin;
+        shards[i].up.fds = fds + fd_off;
+        shards[i].up.nfds = nfds;
+        fd_off += nfds;
+        clients += us.nclients;
+    }
+
+    if (write(chan, "k", 1) != 1) {
+        fprintf(stderr, "hot upgrade: lost the old process\n");
+        exit(1);
+    }
+    close(chan);
+    logmsg(LOG_INFO, EV_SERVER, "Hot upgrade: took over %zu clients in %.1f ms",
+           clients, (now_ns() - start) / 1e6);
+}
+
+/* Rebuild this shard's clients, matches and queue from what the old
+ * process packed. Turn and idle deadlines start afresh.
+ */
+static void upgrade_restore(struct client *head) {
+    struct upgrade_shard us;
+    const char *d = self->up.data;
+    const int *fds = self->up.fds;
+    uint64_t now = now_ns();
+
+    memcpy(&us, d, sizeof(us));
+    d += sizeof(us);
+    fds += 1 + us.has_stats;
+
+    struct client **made = malloc((us.nclients ? us.nclients : 1) * sizeof(*made));
+    struct upgrade_rec *recs = malloc((us.nclients ? us.nclients : 1) * sizeof(*recs));
+    if (made == NULL || recs == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < us.nclients; i++) {
+        struct upgrade_rec *r = &recs[i];
+        memcpy(r, d, sizeof(*r));
+        d += sizeof(*r);
+
+        struct in_addr addr = { r->ipaddr };
+        struct client *p = newclient(head, fds[i], addr);
+        made[i] = p;
+        ip_admit(addr, 1, &p->ip);
+        memcpy(p->name, r->name, sizeof(p->name));
+        p->name[sizeof(p->name) - 1] = '\0';
+        p->name_set = r->name_set;
+        p->in_game = r->in_game;
+        p->speaking = r->speaking;
+        p->binary = r->binary;
+        p->muted = r->muted;
+        if (r->in_game || r->waiting || r->watching >= 0 || r->challenged[0] != '\0') {
+            struct seat *s = seat_attach(p);
+            s->fight.hitpoints = r->hitpoints;
+            s->fight.power_moves = r->power_moves;
+            s->fight.is_turn = r->is_turn;
+            s->fight.speak_count = r->speak_count;
+            memcpy(s->challenged, r->challenged, sizeof(s->challenged));
+            s->challenged[sizeof(s->challenged) - 1] = '\0';
+        }
+        if (r->rlen > 0) {
+            p->rbuf = rbuf_alloc();
+            memcpy(p->rbuf, d, r->rlen);
+        }
+        p->rlen = r->rlen;
+        p->rskip = r->rskip;
+        d += r->rlen;
+        if (r->out_len > 0) {
+            struct msgbuf *m = msgbuf_alloc(r->out_len);
+            memcpy(m->data, d, r->out_len);
+            m->len = r->out_len;
+            queue_msgbuf(p, m);
+            msgbuf_put(m);
+            d += r->out_len;
+        }
+        if (p->name_set) {
+            profile_claim(p, p->name, 1);
+        }
+    }
+
+    for (uint32_t i = 0; i < us.nclients; i++) {
+        struct client *p = made[i];
+        struct upgrade_rec *r = &recs[i];
+        if (p->seat != NULL && r->last_opponent >= 0 && (uint32_t)r->last_opponent < us.nclients) {
+            p->seat->last_opponent = made[r->last_opponent];
+        }
+        if (p->in_game) {
+            struct client *opp = r->opponent >= 0 && (uint32_t)r->opponent < us.nclients ? made[r->opponent] : NULL;
+            if (opp == NULL || !opp->in_game) {
+                p->in_game = 0;     // cannot happen, but never leave a match half set up
+            } else if (p->seat->match == NULL) {
+                p->seat->opponent = opp;
+                opp->seat->opponent = p;
+                p->seat->match = opp->seat->match = match_alloc();
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < us.nclients; i++) {
+        struct client *p = made[i];
+        struct upgrade_rec *r = &recs[i];
+        struct client *x = r->watching >= 0 && (uint32_t)r->watching < us.nclients ? made[r->watching] : NULL;
+        if (x != NULL && x->in_game && x->seat->match != NULL) {
+            struct match *m = x->seat->match;
+            p->seat->watching = m;
+            p->seat->watch_prev = NULL;
+            p->seat->watch_next = m->watchers;
+            if (m->watchers != NULL) {
+                m->watchers->seat->watch_prev = p;
+            }
+            m->watchers = p;
+            STAT(spectators, 1);
+        }
+        if (r->waiting) {
+            enqueue_waiting(p);
+            p->seat->wait_since = now - r->waited_ms * 1000000;
+        }
+        seat_release(p);
+        update_timeout(p);
+        if (watch_client(p) == -1) {
+            logmsg(LOG_ERROR, EV_ERROR, "epoll_ctl: %m");
+            kill_client(p);
+        }
     }
 
-}
\ No newline at end of file
+    free(made);
+    free(recs);
+    self->up.data = NULL;
+}
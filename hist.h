@@ -0,0 +1,83 @@
+/*
+ * Log-linear latency histogram shared by the server and the bot.
+ *
+ * Values below 16 get a bucket each; above that every power of two is
+ * split into 16 sub-buckets, so a reported percentile is within about
+ * 6% of the true value. Recording is a couple of shifts and one add.
+ *
+ * A histogram has a single writer. Updates are relaxed atomic stores so
+ * another thread may read it at any time and see a slightly stale but
+ * never torn value.
+ */
+
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+#include <time.h>
+
+# define HIST_BUCKETS (61 * 16)
+
+struct hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int hist_bucket(uint64_t v) {
+    if (v < 16) {
+        return v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    return (msb - 3) * 16 + (int)((v >> (msb - 4)) & 15);
+}
+
+/* Lower bound of the values counted in bucket b. */
+static inline uint64_t hist_value(int b) {
+    if (b < 16) {
+        return b;
+    }
+    int msb = b / 16 + 3;
+    return ((uint64_t)(16 + b % 16)) << (msb - 4);
+}
+
+static inline void hist_add(struct hist *h, uint64_t v) {
+    uint64_t *b = &h->buckets[hist_bucket(v)];
+    __atomic_store_n(b, *b + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+    if (v > h->max) {
+        __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+    }
+}
+
+/* Add a snapshot of src, which may be live on another thread, to dst. */
+static inline void hist_merge(struct hist *dst, struct hist *src) {
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        uint64_t n = __atomic_load_n(&src->buckets[b], __ATOMIC_RELAXED);
+        dst->buckets[b] += n;
+        dst->count += n;
+    }
+    if (max > dst->max) {
+        dst->max = max;
+    }
+}
+
+static inline uint64_t hist_pct(struct hist *h, double pct) {
+    uint64_t want = (uint64_t)(h->count * pct / 100.0), seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > want) {
+            return hist_value(b);
+        }
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ * Compact binary protocol, shared by the server and the bot.
+ *
+ * The text protocol is the default. A client opts in by sending the
+ * PROTO_HELLO bytes as the very first thing on the connection, instead
+ * of answering the name prompt. The server replies with an FR_HELLO
+ * frame; the text prompt it sends on accept may arrive first, but it
+ * never contains the FR_HELLO byte, so a client discards everything up
+ * to it.
+ *
+ * Client to server, one opcode byte per frame:
+ *     OP_ATTACK, OP_POWERMOVE, OP_MUTE
+ *     OP_NAME, OP_SPEAK     followed by a length byte and that many bytes
+ *
+ * Server to client, a fixed FR_HEADER byte header:
+ *     type, flags, hitpoints, powermoves, opponent hitpoints, damage, length
+ * followed by length bytes of text: the opponent's name for
+ * FR_ENGAGE, the player's name for FR_JOINS and FR_LEFT, the chat line
+ * for FR_TOLD, and for FR_NAME_TAKEN the name, which another player
+ * already has; the client should send OP_NAME again. Hitpoints and powermoves are only meaningful with
+ * FRF_STATUS set.
+ */
+
+#ifndef PROTO_H
+#define PROTO_H
+
+# define PROTO_VERSION 1
+# define PROTO_HELLO "\x01" "GB" "\x01"    // ends with PROTO_VERSION
+# define PROTO_HELLO_LEN 4
+# define FR_HEADER 7
+
+enum { OP_NAME = 1, OP_ATTACK, OP_POWERMOVE, OP_SPEAK, OP_MUTE };
+
+enum {
+    FR_HELLO = 1, FR_WELCOME, FR_JOINS, FR_LEFT, FR_ENGAGE,
+    FR_HIT, FR_MISS, FR_GOT_HIT, FR_GOT_POWER, FR_GOT_MISS,
+    FR_SPOKE, FR_TOLD, FR_MUTED, FR_UNMUTED, FR_NO_SPEAK, FR_SPOKEN_ENOUGH,
+    FR_VICTORY, FR_DEFEAT, FR_FORFEIT, FR_TIMED_OUT, FR_OPP_TIMED_OUT,
+    FR_NAME_TAKEN
+};
+
+/* The match is over after any frame from FR_VICTORY to FR_OPP_TIMED_OUT. */
+# define FR_MATCH_OVER FR_VICTORY
+# define FR_MATCH_OVER_LAST FR_OPP_TIMED_OUT
+
+# define FRF_STATUS 0x01      // hitpoint fields are filled in
+# define FRF_TURN 0x02        // it is now the receiver's move
+# define FRF_WAIT 0x04        // the receiver waits for the opponent
+# define FRF_CAN_POWER 0x08   // a powermove is available this turn
+# define FRF_CAN_SPEAK 0x10   // speaking is allowed this turn
+
+#endif
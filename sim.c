@@ -0,0 +1,189 @@
+/*
+ * Match simulator for the rules in engine.h.
+ *
+ * Plays matches between two scripted fighters entirely in memory, with
+ * no server or sockets, checking every result against the rules as it
+ * goes. At the end it reports how many matches and moves one core gets
+ * through a second, along with the powermove hit rate and how often
+ * the first mover wins.
+ *
+ *     ./sim -n 10000000 -s 42
+ * The same seed plays the same matches. -c sets the percentage of
+ * turns that start with chatter (speaking and muting), which exercises
+ * the speech limits at the cost of throughput.
+ * Exits with status 1 if any rule was broken.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "engine.h"
+#include "hist.h"
+
+// Neither fighter can last more than 6 attacks and 3 powermoves
+# define MAX_TURNS (2 * (FIGHT_HITPOINTS / ATTACK_DAMAGE + POWER_MOVES_MAX))
+
+static uint64_t violations, moves, turns, power_tries, power_hits, first_wins;
+
+static void violation(uint64_t match, const char *what) {
+    if (violations++ < 10) {
+        fprintf(stderr, "match %llu: %s\n", (unsigned long long)match, what);
+    }
+}
+
+/* Check the state every move must leave behind. */
+static void check_state(uint64_t match, const struct fighter *a, const struct fighter *b) {
+    if (a->hitpoints < 0 || a->hitpoints > FIGHT_HITPOINTS
+        || b->hitpoints < 0 || b->hitpoints > FIGHT_HITPOINTS) {
+        violation(match, "hitpoints out of range");
+    }
+    if (a->power_moves < 0 || a->power_moves > POWER_MOVES_MAX
+        || b->power_moves < 0 || b->power_moves > POWER_MOVES_MAX) {
+        violation(match, "powermoves out of range");
+    }
+    if (a->is_turn + b->is_turn != 1) {
+        violation(match, "not exactly one fighter to move");
+    }
+}
+
+/* Chatter before a move: speak until refused, and sometimes have either
+ * side toggle its mute.
+ */
+static void chatter(uint64_t match, struct fighter *me, struct fighter *opp, struct rng *r, struct rng *script) {
+    int spoken = 0;
+
+    if (rng_below(script, 4) == 0) {
+        struct fighter *who = rng_below(script, 2) ? me : opp;
+        int was = who->muted;
+        struct fight_result res = fight_move(who, who == me ? opp : me, FM_MUTE, r);
+        if (who->muted == was || res.event != (who->muted ? FE_MUTED : FE_UNMUTED)) {
+            violation(match, "mute did not toggle");
+        }
+        moves++;
+    }
+
+    for (int i = 0; i < SPEAK_LIMIT + 2; i++) {
+        int muted = opp->muted;
+        struct fight_result res = fight_move(me, opp, FM_SPEAK, r);
+        moves++;
+        if (res.event == FE_SPEAK) {
+            spoken++;
+        }
+        if (muted && res.event != FE_NO_SPEAK) {
+            violation(match, "spoke to a muted opponent");
+        }
+        if (spoken > SPEAK_LIMIT) {
+            violation(match, "spoke too often in one turn");
+        }
+        if (fight_ends_turn(res.event) || res.damage != 0) {
+            violation(match, "speaking ended the turn");
+        }
+    }
+}
+
+/* Play one match to the end and check every step of it. */
+static void play(uint64_t match, struct rng *r, struct rng *script, int chat) {
+    struct fighter f[2] = { { .muted = 0 }, { .muted = 0 } };
+    int n = 0;
+
+    fight_start(&f[0], &f[1], r);
+    int first = f[1].is_turn;
+
+    while (1) {
+        int m = f[1].is_turn;
+        struct fighter *me = &f[m], *opp = &f[!m];
+
+        check_state(match, me, opp);
+        if (chat && rng_below(script, 100) < (uint32_t)chat) {
+            chatter(match, me, opp, r, script);
+        }
+
+        // Out of turn, anything but muting is refused
+        if (fight_move(opp, me, FM_ATTACK, r).event != FE_NONE) {
+            violation(match, "moved out of turn");
+        }
+
+        int hp = opp->hitpoints, pm = me->power_moves;
+        enum fight_move move = pm > 0 && rng_below(script, 2) ? FM_POWERMOVE : FM_ATTACK;
+        struct fight_result res = fight_move(me, opp, move, r);
+        moves++;
+        n++;
+
+        if (move == FM_POWERMOVE) {
+            power_tries++;
+            power_hits += res.event == FE_POWER_HIT;
+            if (me->power_moves != pm - 1) {
+                violation(match, "powermove not used up");
+            }
+        }
+        if (!fight_ends_turn(res.event) || !opp->is_turn || me->is_turn) {
+            violation(match, "turn did not pass");
+        }
+        if (res.damage != (res.event == FE_HIT ? ATTACK_DAMAGE : res.event == FE_POWER_HIT ? POWER_DAMAGE : 0)
+            || opp->hitpoints != (hp > res.damage ? hp - res.damage : 0)) {
+            violation(match, "wrong damage");
+        }
+        if (res.won != (opp->hitpoints == 0)) {
+            violation(match, "win not reported at 0 hitpoints");
+        }
+        if (res.won) {
+            first_wins += m == first;
+            break;
+        }
+        if (n > MAX_TURNS) {
+            violation(match, "match too long");
+            break;
+        }
+    }
+    turns += n;
+}
+
+int main(int argc, char **argv) {
+    uint64_t matches = 1000000, seed = 0;
+    int chat = 0, opt;
+
+    while ((opt = getopt(argc, argv, "n:s:c:")) != -1) {
+        switch (opt) {
+        case 'n':
+            matches = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'c':
+            chat = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n matches] [-s seed] [-c chat_percent]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (seed == 0) {
+        seed = now_ns();
+    }
+
+    // The fighters' choices get their own stream, so the engine's rolls
+    // depend only on the seed and the moves made
+    struct rng r, script;
+    rng_seed(&r, seed);
+    rng_seed(&script, ~seed);
+
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < matches; i++) {
+        play(i, &r, &script, chat);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("seed           %llu\n", (unsigned long long)seed);
+    printf("matches        %llu in %.3fs\n", (unsigned long long)matches, elapsed);
+    printf("matches/sec    %.0f\n", matches / elapsed);
+    printf("moves/sec      %.0f\n", moves / elapsed);
+    printf("ns/match       %.1f\n", elapsed * 1e9 / (matches ? matches : 1));
+    printf("turns/match    %.2f\n", matches ? (double)turns / matches : 0.0);
+    printf("powermove hits %.2f%% (rule %d%%)\n", power_tries ? 100.0 * power_hits / power_tries : 0.0, POWER_CHANCE);
+    printf("first mover    wins %.2f%%\n", matches ? 100.0 * first_wins / matches : 0.0);
+    printf("violations     %llu\n", (unsigned long long)violations);
+    return violations != 0;
+}